@@ -3,600 +3,6384 @@
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <bitset>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <strings.h>
+#include <cstdio>
+#include <chrono>
+#include <iomanip>
+#include <new>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sstream>
+#include <malloc.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 using namespace std;
 
-// Pixel structure
-struct Pixel
+// Counters of every allocation made with new, and so by every vector and string:
+// bytes and number of allocations so far, bytes in use, and the most bytes in use at once
+// (sizes are those of the blocks malloc() hands out, so they are the memory really used)
+atomic<long long> allocated_bytes(0);
+atomic<long long> allocation_count(0);
+atomic<long long> current_bytes(0);
+atomic<long long> peak_bytes(0);
+
+// Allocation counters structure
+// The same counters for the allocations of one job, which runs alongside other jobs
+// and may use several threads (bytes in use count from 0 when the job starts)
+struct AllocationCounters
 {
-    // Red, green, blue color values
-    int red;
-    int green;
-    int blue;
+    atomic<long long> bytes{0};
+    atomic<long long> count{0};
+    atomic<long long> current{0};
+    atomic<long long> peak{0};
 };
 
+// Counters of the job the thread works for, which its allocations also count in (nullptr for none)
+thread_local AllocationCounters* job_allocations = nullptr;
+
 /**
- * Gets an integer from a binary stream.
- * Helper function for read_image()
- * @param stream the stream
- * @param offset the offset at which to read the integer
- * @param bytes  the number of bytes to read
- * @return the integer starting at the given offset
- */ 
-int get_int(fstream& stream, int offset, int bytes)
+ * Adds bytes to a count of bytes in use and raises the peak to match
+ * @param current the bytes in use
+ * @param peak    the most bytes in use at once
+ * @param bytes   the bytes allocated
+ * @return nothing
+ */
+void add_current_bytes(atomic<long long>& current, atomic<long long>& peak, long long bytes)
 {
-    stream.seekg(offset);
-    int result = 0;
-    int base = 1;
-    for (int i = 0; i < bytes; i++)
-    {   
-        result = result + stream.get() * base;
-        base = base * 256;
+    long long now = current.fetch_add(bytes, memory_order_relaxed) + bytes;
+    long long highest = peak.load(memory_order_relaxed);
+    while (now > highest && !peak.compare_exchange_weak(highest, now, memory_order_relaxed))
+    {
     }
-    return result;
 }
 
-/**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
- */
-vector<vector<Pixel> > read_image(string filename)
+void* operator new(size_t size)
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
-
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
-
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
+    void* block = malloc(size == 0 ? 1 : size);
+    if (block == nullptr)
     {
-        padding = 4 - scanline_size % 4;
+        throw bad_alloc();
     }
-
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+    long long bytes = malloc_usable_size(block);
+    add_current_bytes(current_bytes, peak_bytes, bytes);
+    allocated_bytes.fetch_add(bytes, memory_order_relaxed);
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    AllocationCounters* job = job_allocations;
+    if (job)
     {
-        return {};
+        add_current_bytes(job->current, job->peak, bytes);
+        job->bytes.fetch_add(bytes, memory_order_relaxed);
+        job->count.fetch_add(1, memory_order_relaxed);
     }
+    return block;
+}
 
-    // Create a vector the size of the input image
-    vector<vector<Pixel> > image(height, vector<Pixel> (width));
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
 
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+// Not inlined, so the compiler does not take the free() of a block from new for a mismatch
+__attribute__((noinline)) void operator delete(void* block) noexcept
+{
+    if (block != nullptr)
     {
-        // For each column
-        for (int j = 0; j < width; j++)
+        long long bytes = malloc_usable_size(block);
+        current_bytes.fetch_sub(bytes, memory_order_relaxed);
+        if (job_allocations)
         {
-            // Go to the pixel position
-            stream.seekg(pos);
+            job_allocations->current.fetch_sub(bytes, memory_order_relaxed);
+        }
+        free(block);
+    }
+}
 
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
+void operator delete[](void* block) noexcept
+{
+    operator delete(block);
+}
 
-            // We are ignoring the alpha channel if there is one
+void operator delete(void* block, size_t) noexcept
+{
+    operator delete(block);
+}
 
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
-        }
+void operator delete[](void* block, size_t) noexcept
+{
+    operator delete(block);
+}
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
-    }
+// Allocation statistics structure
+// The allocations made by one operation, such as a decode, a filter or an encode
+struct AllocationStats
+{
+    // Counters when the operation started
+    long long start_bytes;
+    long long start_count;
+    long long start_current;
+    // Bytes and number of allocations made by the operation
+    long long bytes;
+    long long count;
+    // The most bytes in use at once during the operation, and how many more than at its start
+    long long peak;
+    long long peak_growth;
+};
 
-    // Close the stream and return the image vector
-    stream.close();
-    return image;
+/**
+ * Starts counting the allocations of an operation.
+ * Only one operation can be counted at a time, since the peak is shared.
+ * @param stats the statistics of the operation
+ * @return nothing
+ */
+void begin_allocations(AllocationStats& stats)
+{
+    stats.start_bytes = allocated_bytes.load();
+    stats.start_count = allocation_count.load();
+    stats.start_current = current_bytes.load();
+    peak_bytes.store(stats.start_current);
 }
 
 /**
- * Sets a value to the char array starting at the offset using the size
- * specified by the bytes.
- * This is a helper function for write_image()
- * @param arr    Array to set values for
- * @param offset Starting index offset
- * @param bytes  Number of bytes to set
- * @param value  Value to set
+ * Finishes counting the allocations of an operation started with begin_allocations()
+ * @param stats the statistics of the operation, completed
  * @return nothing
  */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+void end_allocations(AllocationStats& stats)
 {
-    for (int i = 0; i < bytes; i++)
-    {
-        arr[offset+i] = (unsigned char)(value>>(i*8));
-    }
+    stats.bytes = allocated_bytes.load() - stats.start_bytes;
+    stats.count = allocation_count.load() - stats.start_count;
+    stats.peak = peak_bytes.load();
+    stats.peak_growth = stats.peak - stats.start_current;
 }
 
 /**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
+ * Prints the allocation statistics of an operation on one line
+ * @param name  name of the operation
+ * @param stats the statistics of the operation
+ * @return nothing
  */
-bool write_image(string filename, const vector<vector<Pixel> >& image)
+void print_allocations(string name, const AllocationStats& stats)
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+    const double MB = 1024.0 * 1024.0;
+    cout << "  " << name << ": " << fixed << setprecision(1) << stats.bytes / MB << " MB in "
+         << stats.count << " allocations, peak " << stats.peak / MB << " MB (+"
+         << stats.peak_growth / MB << " MB)" << endl;
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
 
-    // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
-    int padding_bytes = 0;
-    padding_bytes = (4 - width_bytes % 4) % 4;
-    width_bytes = width_bytes + padding_bytes;
+// Pixel structure
+struct Pixel
+{
+    // Red, green, blue color values
+    int red;
+    int green;
+    int blue;
+};
 
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
+// Number of threads parallel_for_rows() uses, or 0 for one per hardware thread
+int worker_threads = 0;
 
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
+// Rows between the points where a preemptible job may pause
+const int PREEMPTION_ROWS = 64;
 
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
+// Called between chunks of rows by parallel_for_rows() on a thread running a job that
+// may be paused for more urgent work, which the hook runs (nullptr for other threads)
+thread_local const function<void()>* preemption_point = nullptr;
+
+/**
+ * Lets a job that may be preempted pause every PREEMPTION_ROWS rows of a loop that
+ * runs on one thread
+ * @param row the row the loop is about to process
+ * @return nothing
+ */
+void allow_preemption(int row)
+{
+    if (preemption_point && row > 0 && row % PREEMPTION_ROWS == 0)
     {
-        return false;
+        (*preemption_point)();
     }
+}
 
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
-
-    // BMP Header
-    set_bytes(bmp_header,  0, 1, 'B');              // ID field
-    set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
-    set_bytes(bmp_header,  6, 2, 0);                // Reserved
-    set_bytes(bmp_header,  8, 2, 0);                // Reserved
-    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
-
-    // DIB Header
-    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
-    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
-    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
-    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
-    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
-    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
-    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
-    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+/**
+ * Splits a range of rows into bands and processes the bands on separate threads
+ * @param rows the number of rows
+ * @param body called with the first row and one past the last row of each band
+ * @return nothing
+ */
+void parallel_for_rows(int rows, const function<void(int, int)>& body)
+{
+    int threads = (worker_threads > 0) ? worker_threads : max(1, (int)thread::hardware_concurrency());
+    threads = min(threads, rows);
 
-    // Write the BMP and DIB Headers to the file
-    stream.write((char*)bmp_header, sizeof(bmp_header));
-    stream.write((char*)dib_header, sizeof(dib_header));
+    // A preemptible caller processes its band in chunks and runs the hook between them,
+    // while the other threads wait at the end of their current chunk
+    const function<void()>* hook = preemption_point;
+    atomic<bool> paused(false);
 
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
+    // The other threads count their allocations in the caller's job
+    AllocationCounters* counters = job_allocations;
+    auto run_band = [&](int first, int last, bool caller)
+    {
+        job_allocations = counters;
+        if (!hook)
+        {
+            body(first, last);
+            return;
+        }
+        for (int row = first; row < last; row += PREEMPTION_ROWS)
+        {
+            body(row, min(last, row + PREEMPTION_ROWS));
+            if (caller)
+            {
+                paused = true;
+                (*hook)();
+                paused = false;
+            }
+            while (paused)
+            {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        }
+    };
+    if (threads <= 1)
+    {
+        run_band(0, rows, true);
+        return;
+    }
 
-    // Pixel Array (Left to right, bottom to top, with padding)
-    for (int h = height_pixels - 1; h >= 0; h--)
+    // The calling thread takes the first band itself, and the bands of any threads that
+    // could not be started (when memory for their stacks runs out)
+    vector<thread> workers;
+    workers.reserve(threads - 1);
+    int started = 1;
+    for (; started < threads; started++)
     {
-        for (int w = 0; w < width_pixels; w++)
+        try
+        {
+            workers.emplace_back(run_band, (long long)rows * started / threads, (long long)rows * (started + 1) / threads, false);
+        }
+        catch (const system_error&)
+        {
+            break;
+        }
+        catch (const bad_alloc&)
         {
-            // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
+            break;
         }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
     }
+    run_band(0, rows / threads, true);
+    for (int i = started; i < threads; i++)
+    {
+        run_band((long long)rows * i / threads, (long long)rows * (i + 1) / threads, true);
+    }
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+}
 
-    // Close the stream and return true
-    stream.close();
-    return true;
+/**
+ * Converts 24-bit BMP pixels (Blue, Green, Red) into pixels
+ * @param bytes  the pixels as stored in the file
+ * @param pixels the pixels to fill
+ * @param count  number of pixels
+ * @return nothing
+ */
+void bgr24_to_pixels_scalar(const unsigned char* bytes, Pixel* pixels, int count)
+{
+    for (int j = 0; j < count; j++)
+    {
+        pixels[j].blue = bytes[j * 3];
+        pixels[j].green = bytes[j * 3 + 1];
+        pixels[j].red = bytes[j * 3 + 2];
+    }
 }
 
+/**
+ * Converts 32-bit BMP pixels (Blue, Green, Red, unused) into pixels
+ * @param bytes  the pixels as stored in the file
+ * @param pixels the pixels to fill
+ * @param count  number of pixels
+ * @return nothing
+ */
+void bgrx32_to_pixels_scalar(const unsigned char* bytes, Pixel* pixels, int count)
+{
+    for (int j = 0; j < count; j++)
+    {
+        pixels[j].blue = bytes[j * 4];
+        pixels[j].green = bytes[j * 4 + 1];
+        pixels[j].red = bytes[j * 4 + 2];
+    }
+}
 
-vector<vector<Pixel> > process_1(const vector<vector<Pixel> >& image)
-// Adds vignette effect to image (dark corners)
-// read in an image, process the pixel values using Process 1, and write the result out to a new image file.
+/**
+ * Converts pixels into 24-bit BMP pixels (Blue, Green, Red), keeping the low byte
+ * of each color value
+ * @param pixels the pixels
+ * @param bytes  the pixels in file format to fill
+ * @param count  number of pixels
+ * @return nothing
+ */
+void pixels_to_bgr24_scalar(const Pixel* pixels, unsigned char* bytes, int count)
 {
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+    for (int j = 0; j < count; j++)
+    {
+        bytes[j * 3] = pixels[j].blue;
+        bytes[j * 3 + 1] = pixels[j].green;
+        bytes[j * 3 + 2] = pixels[j].red;
+    }
+}
 
+// The shuffle kernels below move whole pixels with byte shuffles (SSSE3 pshufb).
+// They are compiled for SSSE3 whatever the compiler flags and only used when the
+// processor supports it, so the same binary runs everywhere.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SHUFFLE_KERNELS 1
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+// Four pixels are three vectors of four color values: (R0 G0 B0 R1) (G1 B1 R2 G2) (B2 R3 G3 B3)
+static_assert(sizeof(Pixel) == 12, "the shuffle kernels need pixels of three packed ints");
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
-            
-            // Get the color values for a single pixel in the input 2D vector
-            int red = image[row][col].red;
-            int green = image[row][col].green;
-            int blue = image[row][col].blue;
+/**
+ * Checks whether the processor supports the SSSE3 shuffle kernels
+ * @return True if the kernels can be used
+ */
+bool shuffle_kernels_supported()
+{
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
 
-            
-            double distance = sqrt(pow((col - width_pixels/2), 2) + pow((row - height_pixels/2), 2));
-            double scaling_factor = (height_pixels - distance)/height_pixels;
+/**
+ * Converts 24-bit BMP pixels into pixels four at a time.
+ * Helper function for bgr24_to_pixels()
+ * @param bytes  the pixels as stored in the file
+ * @param pixels the pixels to fill
+ * @param count  number of pixels
+ * @return the number of pixels converted (the rest are left to the scalar kernel)
+ */
+__attribute__((target("ssse3"))) int bgr24_to_pixels_ssse3(const unsigned char* bytes, Pixel* pixels, int count)
+{
+    // Each output value takes one byte of B0 G0 R0 B1 G1 R1 B2 G2 R2 B3 G3 R3 (-1 gives zero)
+    const __m128i first = _mm_setr_epi8(2, -1, -1, -1, 1, -1, -1, -1, 0, -1, -1, -1, 5, -1, -1, -1);
+    const __m128i second = _mm_setr_epi8(4, -1, -1, -1, 3, -1, -1, -1, 8, -1, -1, -1, 7, -1, -1, -1);
+    const __m128i third = _mm_setr_epi8(6, -1, -1, -1, 11, -1, -1, -1, 10, -1, -1, -1, 9, -1, -1, -1);
+
+    // Each load reads 16 bytes for 12, so stop while that stays inside the input
+    int j = 0;
+    for (; j + 6 <= count; j += 4)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)(bytes + j * 3));
+        __m128i* out = (__m128i*)(pixels + j);
+        _mm_storeu_si128(out, _mm_shuffle_epi8(in, first));
+        _mm_storeu_si128(out + 1, _mm_shuffle_epi8(in, second));
+        _mm_storeu_si128(out + 2, _mm_shuffle_epi8(in, third));
+    }
+    return j;
+}
 
+/**
+ * Converts 32-bit BMP pixels into pixels four at a time.
+ * Helper function for bgrx32_to_pixels()
+ * @param bytes  the pixels as stored in the file
+ * @param pixels the pixels to fill
+ * @param count  number of pixels
+ * @return the number of pixels converted (the rest are left to the scalar kernel)
+ */
+__attribute__((target("ssse3"))) int bgrx32_to_pixels_ssse3(const unsigned char* bytes, Pixel* pixels, int count)
+{
+    const __m128i first = _mm_setr_epi8(2, -1, -1, -1, 1, -1, -1, -1, 0, -1, -1, -1, 6, -1, -1, -1);
+    const __m128i second = _mm_setr_epi8(5, -1, -1, -1, 4, -1, -1, -1, 10, -1, -1, -1, 9, -1, -1, -1);
+    const __m128i third = _mm_setr_epi8(8, -1, -1, -1, 14, -1, -1, -1, 13, -1, -1, -1, 12, -1, -1, -1);
 
-            // Save the new color values to the corresponding pixel in the new 2D vector
-            new_image[row][col].red = red * scaling_factor;
-            new_image[row][col].green = green * scaling_factor;
-            new_image[row][col].blue = blue * scaling_factor;
-            
+    int j = 0;
+    for (; j + 4 <= count; j += 4)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)(bytes + j * 4));
+        __m128i* out = (__m128i*)(pixels + j);
+        _mm_storeu_si128(out, _mm_shuffle_epi8(in, first));
+        _mm_storeu_si128(out + 1, _mm_shuffle_epi8(in, second));
+        _mm_storeu_si128(out + 2, _mm_shuffle_epi8(in, third));
+    }
+    return j;
+}
 
-           /* Block to test that copying image correctly
-           new_image[row][col].red = red;
-           new_image[row][col].green = green;
-           new_image[row][col].blue = blue;
-           */
-            
-        }
+/**
+ * Converts pixels into 24-bit BMP pixels four at a time.
+ * Helper function for pixels_to_bgr24()
+ * @param pixels the pixels
+ * @param bytes  the pixels in file format to fill
+ * @param count  number of pixels
+ * @return the number of pixels converted (the rest are left to the scalar kernel)
+ */
+__attribute__((target("ssse3"))) int pixels_to_bgr24_ssse3(const Pixel* pixels, unsigned char* bytes, int count)
+{
+    // Each vector supplies the low bytes of its values to some of the 12 output bytes
+    const __m128i first = _mm_setr_epi8(8, 4, 0, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i second = _mm_setr_epi8(-1, -1, -1, 4, 0, -1, -1, 12, 8, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i third = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 0, -1, -1, 12, 8, 4, -1, -1, -1, -1);
+
+    // Each store writes 16 bytes for 12 (the next store overwrites the extra 4),
+    // so stop while that stays inside the output
+    int j = 0;
+    for (; j + 6 <= count; j += 4)
+    {
+        const __m128i* in = (const __m128i*)(pixels + j);
+        __m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128(in), first),
+                                                _mm_shuffle_epi8(_mm_loadu_si128(in + 1), second)),
+                                   _mm_shuffle_epi8(_mm_loadu_si128(in + 2), third));
+        _mm_storeu_si128((__m128i*)(bytes + j * 3), out);
     }
-        
-    // Return the new 2D vector
-    return new_image;
+    return j;
 }
+#endif
 
-vector<vector<Pixel> > process_2(const vector<vector<Pixel> >& image, double scaling_factor) {
-    // Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+/**
+ * Converts 24-bit BMP pixels (Blue, Green, Red) into pixels, with the shuffle
+ * kernel where the processor supports it
+ * @param bytes  the pixels as stored in the file
+ * @param pixels the pixels to fill
+ * @param count  number of pixels
+ * @return nothing
+ */
+void bgr24_to_pixels(const unsigned char* bytes, Pixel* pixels, int count)
+{
+    int done = 0;
+#ifdef HAVE_SHUFFLE_KERNELS
+    if (shuffle_kernels_supported())
+    {
+        done = bgr24_to_pixels_ssse3(bytes, pixels, count);
+    }
+#endif
+    bgr24_to_pixels_scalar(bytes + done * 3, pixels + done, count - done);
+}
 
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+/**
+ * Converts 32-bit BMP pixels (Blue, Green, Red, unused) into pixels, with the
+ * shuffle kernel where the processor supports it
+ * @param bytes  the pixels as stored in the file
+ * @param pixels the pixels to fill
+ * @param count  number of pixels
+ * @return nothing
+ */
+void bgrx32_to_pixels(const unsigned char* bytes, Pixel* pixels, int count)
+{
+    int done = 0;
+#ifdef HAVE_SHUFFLE_KERNELS
+    if (shuffle_kernels_supported())
+    {
+        done = bgrx32_to_pixels_ssse3(bytes, pixels, count);
+    }
+#endif
+    bgrx32_to_pixels_scalar(bytes + done * 4, pixels + done, count - done);
+}
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+/**
+ * Converts pixels into 24-bit BMP pixels (Blue, Green, Red), keeping the low byte
+ * of each color value, with the shuffle kernel where the processor supports it
+ * @param pixels the pixels
+ * @param bytes  the pixels in file format to fill
+ * @param count  number of pixels
+ * @return nothing
+ */
+void pixels_to_bgr24(const Pixel* pixels, unsigned char* bytes, int count)
+{
+    int done = 0;
+#ifdef HAVE_SHUFFLE_KERNELS
+    if (shuffle_kernels_supported())
+    {
+        done = pixels_to_bgr24_ssse3(pixels, bytes, count);
+    }
+#endif
+    pixels_to_bgr24_scalar(pixels + done, bytes + done * 3, count - done);
+}
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+/**
+ * Gets an unsigned little-endian integer from the headers of a BMP file.
+ * Helper function for read_image()
+ * @param header the bytes at the start of the file
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read (at most 4)
+ * @return the integer starting at the given offset
+ */ 
+long long get_int(const unsigned char* header, int offset, int bytes)
+{
+    long long result = 0;
+    long long base = 1;
+    for (int i = 0; i < bytes; i++)
+    {   
+        result = result + header[offset + i] * base;
+        base = base * 256;
+    }
+    return result;
+}
 
-        // Get the color values for a single pixel in the input 2D vector
-        int red = image[row][col].red;
-        int green = image[row][col].green;
-        int blue = image[row][col].blue;
+/**
+ * Converts one scan line of a BMP file into pixels.
+ * Helper function for read_image()
+ * @param bytes          the scan line as stored in the file
+ * @param row            the row of pixels to fill
+ * @param bits_per_pixel bits per pixel of the file
+ * @param palette        color palette for files with 8 or fewer bits per pixel
+ * @return nothing
+ */
+void decode_row(const unsigned char* bytes, vector<Pixel>& row, int bits_per_pixel, const vector<Pixel>& palette)
+{
+    int width = row.size();
+    if (bits_per_pixel >= 24)
+    {
+        // Note: BMP files store pixels in blue, green, red order
+        // We are ignoring the alpha channel if there is one
+        if (bits_per_pixel == 24)
+        {
+            bgr24_to_pixels(bytes, row.data(), width);
+        }
+        else
+        {
+            bgrx32_to_pixels(bytes, row.data(), width);
+        }
+        return;
+    }
 
-        // Perform the operation on the color values (refer to Runestone for this)
+    // Palette indexes are packed into bytes, leftmost pixel in the most significant bits
+    int per_byte = 8 / bits_per_pixel;
+    int mask = (1 << bits_per_pixel) - 1;
+    for (int j = 0; j < width; j++)
+    {
+        int shift = 8 - bits_per_pixel * (j % per_byte + 1);
+        row[j] = palette[(bytes[j / per_byte] >> shift) & mask];
+    }
+}
+
+// Bit field structure
+// Where one color channel sits inside a 16 or 32-bit pixel
+struct BitField
+{
+    // Bits of the pixel that hold the channel, and how far to shift them down
+    unsigned int mask;
+    int shift;
+    // Channel values widened to 8 bits, indexed by the shifted channel bits
+    vector<unsigned char> table;
+};
+
+/**
+ * Describes a color channel given by a bit mask.
+ * Channels wider than 8 bits only keep their top 8 bits.
+ * Helper function for read_image()
+ * @param mask the bits of the pixel that hold the channel
+ * @return the channel description with its lookup table
+ */
+BitField make_bit_field(unsigned int mask)
+{
+    BitField field;
+    field.mask = mask;
+    field.shift = 0;
+    while (mask != 0 && (mask & 1) == 0)
+    {
+        mask >>= 1;
+        field.shift++;
+    }
+    int bits = 0;
+    while (mask & 1)
+    {
+        mask >>= 1;
+        bits++;
+    }
+    if (bits > 8)
+    {
+        field.shift += bits - 8;
+        bits = 8;
+    }
+
+    // Only the bits the table covers are looked up, so no pixel can index past its end
+    field.mask = ((1u << bits) - 1) << field.shift;
+
+    // Scale each value so the largest one becomes 255
+    int largest = (1 << bits) - 1;
+    field.table.resize(largest + 1);
+    for (int value = 0; value <= largest; value++)
+    {
+        field.table[value] = (largest == 0) ? 0 : (value * 255 + largest / 2) / largest;
+    }
+    return field;
+}
+
+/**
+ * Converts one scan line of 16 or 32-bit pixels with channel bit masks into pixels.
+ * Helper function for read_image()
+ * @param bytes          the scan line as stored in the file
+ * @param row            the row of pixels to fill
+ * @param bits_per_pixel 16 or 32
+ * @param fields         the red, green and blue channels
+ * @return nothing
+ */
+void decode_bit_fields_row(const unsigned char* bytes, vector<Pixel>& row, int bits_per_pixel, const vector<BitField>& fields)
+{
+    const BitField& red = fields[0];
+    const BitField& green = fields[1];
+    const BitField& blue = fields[2];
+    int width = row.size();
+    for (int j = 0; j < width; j++)
+    {
+        // Pixels are little-endian
+        unsigned int value;
+        if (bits_per_pixel == 16)
+        {
+            value = bytes[j * 2] | (bytes[j * 2 + 1] << 8);
+        }
+        else
+        {
+            value = bytes[j * 4] | (bytes[j * 4 + 1] << 8) | (bytes[j * 4 + 2] << 16) | ((unsigned int)bytes[j * 4 + 3] << 24);
+        }
+        row[j].red = red.table[(value & red.mask) >> red.shift];
+        row[j].green = green.table[(value & green.mask) >> green.shift];
+        row[j].blue = blue.table[(value & blue.mask) >> blue.shift];
+    }
+}
+
+/**
+ * Expands RLE8 or RLE4 compressed pixel data into one palette index per pixel.
+ * Pixels skipped by delta codes keep index 0, and runs past the edge are clipped.
+ * Helper function for read_image()
+ * @param data           the compressed pixel data
+ * @param width          width of the image
+ * @param height         height of the image
+ * @param bits_per_pixel 8 for RLE8 or 4 for RLE4
+ * @param indexes        filled with the palette indexes, bottom row first
+ * @return nothing
+ */
+void decode_rle(const vector<unsigned char>& data, int width, int height, int bits_per_pixel, vector<unsigned char>& indexes)
+{
+    indexes.assign((size_t)width * height, 0);
+    size_t pos = 0;
+    int x = 0;
+    int y = 0;
+    while (pos + 1 < data.size() && y < height)
+    {
+        int count = data[pos];
+        int value = data[pos + 1];
+        pos += 2;
+        unsigned char* out = &indexes[(size_t)y * width];
+
+        if (count > 0)
+        {
+            // Encoded run: one index repeated (RLE8) or two alternating indexes (RLE4)
+            int end = min(x + count, width);
+            if (bits_per_pixel == 8 || (value >> 4) == (value & 15))
+            {
+                if (end > x)
+                {
+                    memset(out + x, bits_per_pixel == 8 ? value : value & 15, end - x);
+                }
+            }
+            else
+            {
+                for (int i = x; i < end; i++)
+                {
+                    out[i] = ((i - x) % 2 == 0) ? value >> 4 : value & 15;
+                }
+            }
+            x += count;
+        }
+        else if (value == 0)
+        {
+            // End of line
+            x = 0;
+            y++;
+        }
+        else if (value == 1)
+        {
+            // End of bitmap
+            break;
+        }
+        else if (value == 2)
+        {
+            // Delta: move right and up by the next two bytes
+            if (pos + 1 >= data.size())
+            {
+                break;
+            }
+            x += data[pos];
+            y += data[pos + 1];
+            pos += 2;
+        }
+        else
+        {
+            // Absolute mode: literal indexes, padded to a 16-bit boundary
+            int bytes = (bits_per_pixel == 8) ? value : (value + 1) / 2;
+            if (pos + bytes > data.size())
+            {
+                break;
+            }
+            for (int i = 0; i < value && x + i < width; i++)
+            {
+                if (bits_per_pixel == 8)
+                {
+                    out[x + i] = data[pos + i];
+                }
+                else
+                {
+                    out[x + i] = (i % 2 == 0) ? data[pos + i / 2] >> 4 : data[pos + i / 2] & 15;
+                }
+            }
+            x += value;
+            pos += bytes + bytes % 2;
+        }
+    }
+}
+
+// BMP information structure
+// The properties of a BMP file given by its headers
+struct BmpInfo
+{
+    int width;
+    int height;
+    int bits_per_pixel;
+    int compression;
+    bool run_length_encoded;
+    // Offset of the pixel array and its size in the file
+    long long start;
+    long long array_size;
+    // Size of a scan line in the file, including padding
+    long long row_bytes;
+    // Size of the whole file
+    long long file_size;
+    // Size of the DIB header, and the number of palette entries (0 for all of them)
+    int dib_header_size;
+    int colors_used;
+    // Red, green and blue bit masks of 16 and 32-bit pixels
+    unsigned int masks[3];
+};
+
+// The headers read at once: the BMP and DIB headers, and the bit masks that may follow
+const int HEADER_BYTES = 66;
+
+// Most pixels a run-length encoded image may declare (8192 x 8192). Its compressed
+// size says nothing about how large it decodes, as delta and end-of-line codes skip
+// any number of pixels in a few bytes.
+const long long MAX_RLE_PIXELS = 1LL << 26;
+
+/**
+ * Checks the headers of a BMP file and gets the properties of the image from them.
+ * Helper function for read_image()
+ * @param header    the first HEADER_BYTES bytes of the file (zero past the end of short files)
+ * @param file_size the size of the file
+ * @param info      filled with the properties
+ * @return True if the headers describe a valid image that fits in the file and false otherwise
+ */
+bool parse_headers(const unsigned char* header, long long file_size, BmpInfo& info)
+{
+    // Get the image properties (sizes are 64-bit so multi-gigabyte images work)
+    long long signature = get_int(header, 0, 2);
+    long long stored_size = get_int(header, 2, 4);
+    long long start = get_int(header, 10, 4);
+    long long dib_header_size = get_int(header, 14, 4);
+    long long width = get_int(header, 18, 4);
+    long long height = get_int(header, 22, 4);
+    long long planes = get_int(header, 26, 2);
+    int bits_per_pixel = get_int(header, 28, 2);
+    long long compression = get_int(header, 30, 4);
+    long long compressed_size = get_int(header, 34, 4);
+    long long colors_used = get_int(header, 46, 4);
+
+    // Not a valid image unless the headers are complete and describe a bottom-up bitmap
+    // (widths and heights are signed, so values from 2^31 up are negative)
+    if (file_size < 54 || signature != 0x4D42 || dib_header_size < 40 || planes != 1 ||
+        width <= 0 || width > 0x7FFFFFFF || height <= 0 || height > 0x7FFFFFFF ||
+        start < 14 + dib_header_size || start > file_size)
+    {
+        return false;
+    }
+    if (bits_per_pixel != 1 && bits_per_pixel != 4 && bits_per_pixel != 8 &&
+        bits_per_pixel != 16 && bits_per_pixel != 24 && bits_per_pixel != 32)
+    {
+        return false;
+    }
+
+    // Run-length encoded files store runs of palette indexes instead of scan lines,
+    // and bit field masks are only valid for 16 and 32-bit pixels
+    bool run_length_encoded = (compression == 1 && bits_per_pixel == 8) || (compression == 2 && bits_per_pixel == 4);
+    if (compression != 0 && !run_length_encoded && !(compression == 3 && (bits_per_pixel == 16 || bits_per_pixel == 32)))
+    {
+        return false;
+    }
+
+    // 16-bit pixels pack the channels into bit fields (5 bits each unless BI_BITFIELDS
+    // gives masks, which follow the 40-byte header or sit at the same place in larger ones)
+    unsigned int masks[3] = {0x7C00, 0x03E0, 0x001F};
+    for (int i = 0; i < 3 && compression == 3; i++)
+    {
+        masks[i] = get_int(header, 54 + i * 4, 4);
+    }
+
+    // Each mask must be one run of bits, and no two channels may share a bit
+    for (int i = 0; i < 3; i++)
+    {
+        unsigned int run = masks[i];
+        while (run != 0 && (run & 1) == 0)
+        {
+            run >>= 1;
+        }
+        if ((run & (run + 1)) != 0 || (masks[i] & masks[(i + 1) % 3]) != 0)
+        {
+            return false;
+        }
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    long long scanline_size = (width * bits_per_pixel + 7) / 8;
+    long long padding = 0;
+    if (scanline_size % 4 != 0)
+    {
+        padding = 4 - scanline_size % 4;
+    }
+
+    // Not a valid image if the pixel data does not fill the file exactly, or runs past
+    // its end (files over 4 GB cannot give their size and store 0 instead)
+    long long array_size = run_length_encoded ? compressed_size : (scanline_size + padding) * height;
+    if (run_length_encoded && width * height > MAX_RLE_PIXELS)
+    {
+        return false;
+    }
+    bool size_fits = (start + array_size <= 0xFFFFFFFFLL);
+    if ((stored_size != start + array_size && (size_fits || stored_size != 0)) || start + array_size > file_size)
+    {
+        return false;
+    }
+
+    info.width = width;
+    info.height = height;
+    info.bits_per_pixel = bits_per_pixel;
+    info.compression = compression;
+    info.run_length_encoded = run_length_encoded;
+    info.start = start;
+    info.array_size = array_size;
+    info.row_bytes = scanline_size + padding;
+    info.file_size = file_size;
+    info.dib_header_size = dib_header_size;
+    info.colors_used = min(colors_used, 256LL);
+    copy(masks, masks + 3, info.masks);
+    return true;
+}
+
+/**
+ * Gets the properties of a BMP image from its headers alone, with a single read
+ * and without touching the palette or the pixels
+ * @param filename BMP image filename
+ * @param info     filled with the properties
+ * @return True if the file is a valid image and false otherwise
+ */
+bool probe_image(string filename, BmpInfo& info)
+{
+    int descriptor = open(filename.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    struct stat status;
+    unsigned char header[HEADER_BYTES] = {0};
+    bool valid = fstat(descriptor, &status) == 0 && pread(descriptor, header, HEADER_BYTES, 0) >= 54 &&
+                 parse_headers(header, status.st_size, info);
+    close(descriptor);
+    return valid;
+}
+
+// Row reader structure
+// An open BMP file whose pixels are read one scan line at a time
+struct RowReader
+{
+    fstream stream;
+    // Image properties from the headers
+    int width;
+    int height;
+    int bits_per_pixel;
+    long long start;
+    long long compressed_size;
+    bool run_length_encoded;
+    // Size of a scan line in the file, including padding
+    long long row_bytes;
+    // Number of scan lines read so far
+    int rows_read;
+    vector<Pixel> palette;
+    vector<BitField> fields;
+    vector<unsigned char> buffer;
+};
+
+/**
+ * Opens a BMP file and reads its headers and palette, ready to read the pixels
+ * one scan line at a time
+ * @param reader   the reader to set up
+ * @param filename BMP image filename
+ * @return True if the file is a valid image and false otherwise
+ */
+bool open_row_reader(RowReader& reader, string filename)
+{
+    // Open the binary file and read all the headers at once
+    fstream& stream = reader.stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    long long file_size = stream.tellg();
+    stream.seekg(0);
+    unsigned char header[HEADER_BYTES] = {0};
+    stream.read((char*)header, HEADER_BYTES);
+    stream.clear();
+
+    BmpInfo info;
+    if (!parse_headers(header, file_size, info))
+    {
+        return false;
+    }
+    int bits_per_pixel = info.bits_per_pixel;
+
+    // 16-bit pixels, and 32-bit pixels with masks, are decoded through their bit fields
+    vector<BitField>& fields = reader.fields;
+    if (bits_per_pixel == 16 || (bits_per_pixel == 32 && info.compression == 3))
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            fields.push_back(make_bit_field(info.masks[i]));
+        }
+    }
+
+    // Images with 8 or fewer bits per pixel store indexes into a color palette
+    // (unused entries stay black so corrupt indexes cannot read past the end)
+    vector<Pixel>& palette = reader.palette;
+    if (bits_per_pixel <= 8)
+    {
+        int palette_size = (info.colors_used == 0) ? (1 << bits_per_pixel) : info.colors_used;
+        vector<unsigned char> entries(palette_size * 4);
+        stream.seekg(14 + info.dib_header_size);
+        stream.read((char*)entries.data(), entries.size());
+        palette.resize(256);
+        for (int i = 0; i < palette_size; i++)
+        {
+            palette[i].blue = entries[i * 4];
+            palette[i].green = entries[i * 4 + 1];
+            palette[i].red = entries[i * 4 + 2];
+        }
+    }
+
+    reader.width = info.width;
+    reader.height = info.height;
+    reader.bits_per_pixel = bits_per_pixel;
+    reader.start = info.start;
+    reader.compressed_size = info.array_size;
+    reader.run_length_encoded = info.run_length_encoded;
+    reader.row_bytes = info.row_bytes;
+    reader.rows_read = 0;
+    reader.buffer.resize(reader.row_bytes);
+    stream.clear();
+    stream.seekg(info.start);
+    return true;
+}
+
+/**
+ * Converts one scan line (or the part of one that starts at the given bytes) of a BMP
+ * file opened with open_row_reader() into pixels
+ * @param reader the reader that read the headers
+ * @param bytes  the scan line as stored in the file
+ * @param row    the row of pixels to fill
+ * @return nothing
+ */
+void decode_scan_line(const RowReader& reader, const unsigned char* bytes, vector<Pixel>& row)
+{
+    if (reader.fields.empty())
+    {
+        decode_row(bytes, row, reader.bits_per_pixel, reader.palette);
+    }
+    else
+    {
+        decode_bit_fields_row(bytes, row, reader.bits_per_pixel, reader.fields);
+    }
+}
+
+/**
+ * Reads exactly the given number of bytes at an offset of a file, without using or
+ * moving its file position, so several threads can read the same file at once
+ * @param descriptor the file descriptor
+ * @param buffer     where to store the bytes
+ * @param size       the number of bytes to read
+ * @param offset     the offset at which to read
+ * @return True if every byte was read and false otherwise
+ */
+bool read_at(int descriptor, unsigned char* buffer, size_t size, long long offset)
+{
+    while (size > 0)
+    {
+        ssize_t count = pread(descriptor, buffer, size, offset);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+/**
+ * Reads the next scan line of a BMP file opened with open_row_reader().
+ * Note: BMP files store pixels from bottom to top, so the first call gives the last row.
+ * Run-length encoded files cannot be read this way.
+ * @param reader the reader
+ * @param row    the row of pixels to fill (resized to the image width)
+ * @return the index of the row in the image (0 is the top row), or -1 after the last row
+ */
+int read_row(RowReader& reader, vector<Pixel>& row)
+{
+    if (reader.rows_read == reader.height || reader.run_length_encoded)
+    {
+        return -1;
+    }
+
+    // Read the whole scan line, including its padding, at once
+    reader.stream.read((char*)reader.buffer.data(), reader.buffer.size());
+    row.resize(reader.width);
+    decode_scan_line(reader, reader.buffer.data(), row);
+    reader.rows_read++;
+    return reader.height - reader.rows_read;
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image as a vector.
+ * Uncompressed files are decoded by several threads, each reading its own band of rows.
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel> > read_image(string filename)
+{
+    // Open the file and read the headers, return empty vector if this is not a valid image
+    RowReader reader;
+    if (!open_row_reader(reader, filename))
+    {
+        return {};
+    }
+    int width = reader.width;
+    int height = reader.height;
+
+    // Create a vector the size of the input image (return empty vector if there is
+    // not enough memory for it)
+    vector<vector<Pixel> > image;
+    try
+    {
+        image.assign(height, vector<Pixel> (width));
+
+        if (reader.run_length_encoded)
+        {
+            // Expand the runs and look up each index in the palette (bottom row first)
+            vector<unsigned char> data(reader.compressed_size);
+            reader.stream.read((char*)data.data(), data.size());
+            vector<unsigned char> indexes;
+            decode_rle(data, width, height, reader.bits_per_pixel, indexes);
+            for (int i = 0; i < height; i++)
+            {
+                const unsigned char* row_indexes = &indexes[(size_t)i * width];
+                for (int j = 0; j < width; j++)
+                {
+                    image[height - 1 - i][j] = reader.palette[row_indexes[j]];
+                }
+            }
+            return image;
+        }
+    }
+    catch (const bad_alloc&)
+    {
+        return {};
+    }
+
+    // Bands of rows are decoded in parallel, each thread with positional reads of its own
+    int descriptor = open(filename.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+        return {};
+    }
+    atomic<bool> complete(true);
+    parallel_for_rows(height, [&](int begin, int end)
+    {
+        // A few scan lines per read keeps the buffer small and the reads large
+        const int ROWS_PER_READ = 64;
+        long long row_bytes = reader.row_bytes;
+        vector<unsigned char> buffer;
+        for (int first = begin; first < end && complete; first += ROWS_PER_READ)
+        {
+            int last = min(first + ROWS_PER_READ, end);
+
+            // Note: BMP files store pixels from bottom to top, so rows first to last - 1
+            // are the scan lines from height - last up to height - 1 - first
+            try
+            {
+                buffer.resize((last - first) * row_bytes);
+            }
+            catch (const bad_alloc&)
+            {
+                // An exception must not leave a worker thread, so the read fails instead
+                complete = false;
+                break;
+            }
+            if (!read_at(descriptor, buffer.data(), buffer.size(), reader.start + (height - last) * row_bytes))
+            {
+                complete = false;
+                break;
+            }
+            for (int i = first; i < last; i++)
+            {
+                decode_scan_line(reader, &buffer[(last - 1 - i) * row_bytes], image[i]);
+            }
+        }
+    });
+    close(descriptor);
+    if (!complete)
+    {
+        return {};
+    }
+    return image;
+}
+
+/**
+ * Sets a value to the char array starting at the offset using the size
+ * specified by the bytes.
+ * This is a helper function for write_image()
+ * @param arr    Array to set values for
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to set
+ * @param value  Value to set
+ * @return nothing
+ */
+void set_bytes(unsigned char arr[], int offset, int bytes, long long value)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        arr[offset+i] = (unsigned char)(value>>(i*8));
+    }
+}
+
+/**
+ * Finds the palette index of every pixel if the image has at most 256 distinct colors.
+ * Colors are looked up in a small open-addressing hash table, and runs of the same
+ * color skip the lookup entirely, so the pass stops early on photographic images.
+ * This is a helper function for write_image()
+ * @param image   the image
+ * @param palette filled with the distinct colors in order of first appearance
+ * @param indexes filled with the palette index of each pixel, row by row from the top
+ * @return True if the image has at most 256 colors and false otherwise
+ */
+bool index_colors(const vector<vector<Pixel> >& image, vector<Pixel>& palette, vector<unsigned char>& indexes)
+{
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Hash table of 24-bit colors (stored plus one so zero marks an empty slot)
+    const int TABLE_SIZE = 1024;
+    vector<unsigned int> keys(TABLE_SIZE, 0);
+    vector<unsigned char> slots(TABLE_SIZE, 0);
+    auto find_slot = [&](unsigned int key)
+    {
+        unsigned int slot = (key * 2654435761u) >> 22;
+        while (keys[slot] != 0 && keys[slot] != key)
+        {
+            slot = (slot + 1) % TABLE_SIZE;
+        }
+        return slot;
+    };
+
+    // Color values are stored as bytes, exactly as the 24-bit writer would
+    auto color_key = [](const Pixel& pixel)
+    {
+        return (((unsigned char)pixel.red << 16) | ((unsigned char)pixel.green << 8) | (unsigned char)pixel.blue) + 1u;
+    };
+
+    // Collect the palette first, so that photos stop at their 257th color without
+    // an index buffer ever being allocated
+    palette.clear();
+    unsigned int last_key = 0;
+    for (int row = 0; row < height_pixels; row++)
+    {
+        for (int col = 0; col < width_pixels; col++)
+        {
+            const Pixel& pixel = image[row][col];
+            unsigned int key = color_key(pixel);
+            if (key == last_key)
+            {
+                continue;
+            }
+            unsigned int slot = find_slot(key);
+            if (keys[slot] == 0)
+            {
+                if (palette.size() == 256)
+                {
+                    return false;
+                }
+                keys[slot] = key;
+                slots[slot] = palette.size();
+                palette.push_back({(unsigned char)pixel.red, (unsigned char)pixel.green, (unsigned char)pixel.blue});
+            }
+            last_key = key;
+        }
+    }
+
+    // Every color is in the table now, so each pixel only needs a lookup
+    indexes.resize((size_t)width_pixels * height_pixels);
+    last_key = 0;
+    unsigned char last_index = 0;
+    size_t position = 0;
+    for (int row = 0; row < height_pixels; row++)
+    {
+        for (int col = 0; col < width_pixels; col++)
+        {
+            unsigned int key = color_key(image[row][col]);
+            if (key != last_key)
+            {
+                last_key = key;
+                last_index = slots[find_slot(key)];
+            }
+            indexes[position++] = last_index;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes the BMP and DIB headers and the palette for an image.
+ * This is a helper function for write_image()
+ * @param stream         the stream to write to
+ * @param width_pixels   width of the image
+ * @param height_pixels  height of the image
+ * @param bits_per_pixel bits per pixel of the pixel array
+ * @param palette        the palette (empty for 24-bit images)
+ * @param compression    compression method (0=BI_RGB, 1=BI_RLE8, 2=BI_RLE4, 3=BI_BITFIELDS)
+ * @param data_bytes     size of the run-length encoded pixel data (unused otherwise)
+ * @param masks          red, green and blue bit masks for BI_BITFIELDS
+ * @return nothing
+ */
+void write_headers(fstream& stream, int width_pixels, int height_pixels, int bits_per_pixel, const vector<Pixel>& palette, int compression = 0, long long data_bytes = 0, const vector<unsigned int>& masks = {})
+{
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    long long width_bytes = ((long long)width_pixels * bits_per_pixel + 7) / 8;
+    long long padding_bytes = 0;
+    padding_bytes = (4 - width_bytes % 4) % 4;
+    width_bytes = width_bytes + padding_bytes;
+
+    // Pixel array and palette size in bytes
+    long long array_bytes = (compression == 1 || compression == 2) ? data_bytes : width_bytes * height_pixels;
+    int palette_bytes = palette.size() * 4 + masks.size() * 4;
+
+    // Create the BMP and DIB Headers
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
+    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
+
+    // Files over 4 GB cannot give their size in the 32-bit fields, so they store 0
+    // (which read_image() accepts for such files)
+    long long file_bytes = BMP_HEADER_SIZE + DIB_HEADER_SIZE + palette_bytes + array_bytes;
+    if (file_bytes > 0xFFFFFFFFLL)
+    {
+        file_bytes = 0;
+        array_bytes = 0;
+    }
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, file_bytes);       // Size of BMP file
+    set_bytes(bmp_header,  6, 2, 0);                // Reserved
+    set_bytes(bmp_header,  8, 2, 0);                // Reserved
+    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+palette_bytes); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, bits_per_pixel);   // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, compression);      // Compression method (0=BI_RGB, 1=BI_RLE8, 2=BI_RLE4, 3=BI_BITFIELDS)
+    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, palette.size());   // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+
+    // Write the BMP and DIB Headers to the file
+    stream.write((char*)bmp_header, sizeof(bmp_header));
+    stream.write((char*)dib_header, sizeof(dib_header));
+
+    // Write the bit masks, then the palette (Blue, Green, Red, unused)
+    vector<unsigned char> entries(palette_bytes, 0);
+    for (size_t i = 0; i < masks.size(); i++)
+    {
+        set_bytes(entries.data(), i * 4, 4, masks[i]);
+    }
+    for (size_t i = 0; i < palette.size(); i++)
+    {
+        entries[masks.size() * 4 + i * 4] = palette[i].blue;
+        entries[masks.size() * 4 + i * 4 + 1] = palette[i].green;
+        entries[masks.size() * 4 + i * 4 + 2] = palette[i].red;
+    }
+    stream.write((char*)entries.data(), entries.size());
+}
+
+/**
+ * Writes exactly the given number of bytes at an offset of a file, without using or
+ * moving its file position, so several threads can write the same file at once
+ * @param descriptor the file descriptor
+ * @param buffer     the bytes to write
+ * @param size       the number of bytes to write
+ * @param offset     the offset at which to write
+ * @return True if every byte was written and false otherwise
+ */
+bool write_at(int descriptor, const unsigned char* buffer, size_t size, long long offset)
+{
+    while (size > 0)
+    {
+        ssize_t count = pwrite(descriptor, buffer, size, offset);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+/**
+ * Writes the uncompressed pixel array of a BMP file whose headers are already written.
+ * The file is preallocated to its final size, then bands of rows are formatted and
+ * written by separate threads with positional writes.
+ * This is a helper function for write_image()
+ * @param filename  the BMP file
+ * @param start     offset of the pixel array (the size of the headers and palette)
+ * @param height    number of rows
+ * @param row_bytes size of a scan line, including padding
+ * @param format    fills the scan line of the row with the given index (0 is the top),
+ *                  leaving the padding bytes alone
+ * @return True if successful and false otherwise
+ */
+bool write_pixel_array(string filename, long long start, int height, long long row_bytes, const function<void(int, unsigned char*)>& format)
+{
+    int descriptor = open(filename.c_str(), O_WRONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+
+    // Reserve the blocks up front where the file system can, otherwise just set the size
+    long long file_size = start + row_bytes * height;
+    if (posix_fallocate(descriptor, 0, file_size) != 0 && ftruncate(descriptor, file_size) != 0)
+    {
+        close(descriptor);
+        return false;
+    }
+
+    atomic<bool> complete(true);
+    parallel_for_rows(height, [&](int begin, int end)
+    {
+        // A few scan lines per write keeps the buffer small and the writes large
+        // (the buffer starts zeroed, which is all the padding needs)
+        const int ROWS_PER_WRITE = 64;
+        vector<unsigned char> buffer(min(ROWS_PER_WRITE, end - begin) * row_bytes, 0);
+        for (int first = begin; first < end && complete; first += ROWS_PER_WRITE)
+        {
+            int last = min(first + ROWS_PER_WRITE, end);
+
+            // Note: BMP files store pixels from bottom to top, so rows first to last - 1
+            // are the scan lines from height - last up to height - 1 - first
+            for (int i = first; i < last; i++)
+            {
+                format(i, &buffer[(last - 1 - i) * row_bytes]);
+            }
+            if (!write_at(descriptor, buffer.data(), (last - first) * row_bytes, start + (height - last) * row_bytes))
+            {
+                complete = false;
+            }
+        }
+    });
+    return close(descriptor) == 0 && complete;
+}
+
+// Row writer structure
+// A 24-bit BMP file being written one scan line at a time
+struct RowWriter
+{
+    fstream stream;
+    int width;
+    int height;
+    // Number of scan lines written so far
+    int rows_written;
+    // One scan line in file format, including padding
+    vector<unsigned char> buffer;
+};
+
+/**
+ * Creates a 24-bit BMP file and writes its headers, ready to write the pixels
+ * one scan line at a time
+ * @param writer   the writer to set up
+ * @param filename The BMP file name to save the image to
+ * @param width    width of the image
+ * @param height   height of the image
+ * @return True if successful and false otherwise
+ */
+bool open_row_writer(RowWriter& writer, string filename, int width, int height)
+{
+    // Open a file stream for writing to a binary file
+    writer.stream.open(filename, ios::out | ios::binary);
+
+    // If there was a problem opening the file, return false
+    if (!writer.stream.is_open())
+    {
+        return false;
+    }
+
+    write_headers(writer.stream, width, height, 24, {});
+    writer.width = width;
+    writer.height = height;
+    writer.rows_written = 0;
+
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    long long width_bytes = width * 3LL;
+    writer.buffer.assign(width_bytes + (4 - width_bytes % 4) % 4, 0);
+    return true;
+}
+
+/**
+ * Writes the next scan line of a file opened with open_row_writer().
+ * Note: BMP files store pixels from bottom to top, so rows must be given bottom row first.
+ * @param writer the writer
+ * @param row    the row of pixels
+ * @return True if successful and false otherwise
+ */
+bool write_row(RowWriter& writer, const vector<Pixel>& row)
+{
+    unsigned char* bytes = writer.buffer.data();
+    pixels_to_bgr24(row.data(), bytes, writer.width);
+    writer.stream.write((char*)bytes, writer.buffer.size());
+    writer.rows_written++;
+    return (bool)writer.stream;
+}
+
+/**
+ * Finishes a file written with write_row()
+ * @param writer the writer
+ * @return True if every row was written successfully and false otherwise
+ */
+bool close_row_writer(RowWriter& writer)
+{
+    writer.stream.close();
+    return writer.rows_written == writer.height && !writer.stream.fail();
+}
+
+/**
+ * Counts how many bytes at the start of an array equal the first one.
+ * Whole 64-bit words are compared against the repeated byte before the tail is
+ * checked one byte at a time.
+ * This is a helper function for encode_rle()
+ * @param bytes the bytes to scan
+ * @param count number of bytes available (at least 1)
+ * @return the length of the run
+ */
+int run_length(const unsigned char* bytes, int count)
+{
+    unsigned long long pattern = bytes[0] * 0x0101010101010101ULL;
+    int length = 1;
+    while (length + 8 <= count)
+    {
+        unsigned long long word;
+        memcpy(&word, bytes + length, 8);
+        if (word != pattern)
+        {
+            break;
+        }
+        length += 8;
+    }
+    while (length < count && bytes[length] == bytes[0])
+    {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * Run-length encodes palette indexes as RLE8 or RLE4 pixel data.
+ * This is a helper function for write_indexed_image()
+ * @param indexes        the palette index of each pixel, row by row from the top
+ * @param width          width of the image
+ * @param height         height of the image
+ * @param bits_per_pixel 8 for RLE8 or 4 for RLE4 (indexes must then be below 16)
+ * @param data           filled with the compressed pixel data
+ * @param limit          the encoding is abandoned once it grows beyond this many bytes
+ * @return True if the encoding fits within the limit and false otherwise
+ */
+bool encode_rle(const vector<unsigned char>& indexes, int width, int height, int bits_per_pixel, vector<unsigned char>& data, size_t limit)
+{
+    data.clear();
+
+    // Rows are stored from bottom to top
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char* row = &indexes[(size_t)(height - 1 - y) * width];
+        int x = 0;
+        while (x < width)
+        {
+            // Encoded runs store a count and the repeated index
+            int run = run_length(row + x, min(width - x, 255));
+            if (run >= 2 || width - x == 1)
+            {
+                data.push_back(run);
+                data.push_back(bits_per_pixel == 8 ? row[x] : (row[x] << 4) | row[x]);
+                x += run;
+                continue;
+            }
+
+            // Otherwise collect literal indexes up to the next run of three or more
+            int end = x + 1;
+            while (end < width && end - x < 255 && run_length(row + end, min(width - end, 3)) < 3)
+            {
+                end++;
+            }
+            int literal = end - x;
+            if (bits_per_pixel == 4 && literal >= 3 && literal % 2 != 0)
+            {
+                // Some decoders drop the last pixel of odd RLE4 literals, so keep them even
+                end--;
+                literal--;
+            }
+            if (literal < 3)
+            {
+                // Absolute mode needs at least three pixels, so emit short runs instead
+                for (; x < end; x++)
+                {
+                    data.push_back(1);
+                    data.push_back(bits_per_pixel == 8 ? row[x] : (row[x] << 4) | row[x]);
+                }
+                continue;
+            }
+
+            // Absolute mode: a zero, the count, the indexes, padded to a 16-bit boundary
+            data.push_back(0);
+            data.push_back(literal);
+            size_t first = data.size();
+            if (bits_per_pixel == 8)
+            {
+                data.insert(data.end(), row + x, row + end);
+            }
+            else
+            {
+                for (int i = 0; i < literal; i += 2)
+                {
+                    data.push_back((row[x + i] << 4) | (i + 1 < literal ? row[x + i + 1] : 0));
+                }
+            }
+            if ((data.size() - first) % 2 != 0)
+            {
+                data.push_back(0);
+            }
+            x = end;
+        }
+
+        // End of line, or end of bitmap after the last row
+        data.push_back(0);
+        data.push_back(y == height - 1 ? 1 : 0);
+        if (data.size() > limit)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes an image given as palette indexes to a BMP file, using 1, 4 or 8 bits
+ * per pixel depending on the size of the palette, or RLE4/RLE8 compression when
+ * that is smaller
+ * @param filename      The BMP file name to save the image to
+ * @param width_pixels  width of the image
+ * @param height_pixels height of the image
+ * @param palette       the palette (at most 256 colors)
+ * @param indexes       the palette index of each pixel, row by row from the top
+ * @return True if successful and false otherwise
+ */
+bool write_indexed_image(string filename, int width_pixels, int height_pixels, const vector<Pixel>& palette, const vector<unsigned char>& indexes)
+{
+    // Open a file stream for writing to a binary file
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+
+    // If there was a problem opening the file, return false
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    // Use the smallest format that holds every palette index
+    int bits_per_pixel = (palette.size() <= 2) ? 1 : (palette.size() <= 16) ? 4 : 8;
+    long long width_bytes = (((long long)width_pixels * bits_per_pixel + 31) / 32) * 4;
+
+    // Run-length encode instead when that beats the uncompressed scan lines
+    int rle_bits = (palette.size() <= 16) ? 4 : 8;
+    vector<unsigned char> data;
+    if (encode_rle(indexes, width_pixels, height_pixels, rle_bits, data, (size_t)width_bytes * height_pixels - 1))
+    {
+        write_headers(stream, width_pixels, height_pixels, rle_bits, palette, rle_bits == 8 ? 1 : 2, data.size());
+        stream.write((char*)data.data(), data.size());
+        stream.close();
+        return true;
+    }
+
+    write_headers(stream, width_pixels, height_pixels, bits_per_pixel, palette);
+    long long start = stream.tellp();
+    stream.close();
+    if (stream.fail())
+    {
+        return false;
+    }
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    int per_byte = 8 / bits_per_pixel;
+    return write_pixel_array(filename, start, height_pixels, width_bytes, [&](int h, unsigned char* row_bytes)
+    {
+        // Pack the palette indexes, leftmost pixel in the most significant bits
+        const unsigned char* row_indexes = &indexes[(size_t)h * width_pixels];
+        if (bits_per_pixel == 8)
+        {
+            copy(row_indexes, row_indexes + width_pixels, row_bytes);
+        }
+        else
+        {
+            fill(row_bytes, row_bytes + (width_pixels + per_byte - 1) / per_byte, 0);
+            for (int w = 0; w < width_pixels; w++)
+            {
+                row_bytes[w / per_byte] |= row_indexes[w] << (8 - bits_per_pixel * (w % per_byte + 1));
+            }
+        }
+    });
+}
+
+/**
+ * Write the input image to a BMP file name specified.
+ * Images with at most 256 colors are written with a palette, using 1, 4 or 8 bits per pixel.
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const vector<vector<Pixel> >& image)
+{
+    // Get the image width and height in pixels
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Use a palette if every color of the image fits in one
+    vector<Pixel> palette;
+    vector<unsigned char> indexes;
+    if (index_colors(image, palette, indexes))
+    {
+        return write_indexed_image(filename, width_pixels, height_pixels, palette, indexes);
+    }
+
+    // Otherwise write 24-bit pixels
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    write_headers(stream, width_pixels, height_pixels, 24, {});
+    long long start = stream.tellp();
+    stream.close();
+    if (stream.fail())
+    {
+        return false;
+    }
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    long long width_bytes = ((long long)width_pixels * 3 + 3) / 4 * 4;
+    return write_pixel_array(filename, start, height_pixels, width_bytes, [&](int h, unsigned char* row_bytes)
+    {
+        pixels_to_bgr24(image[h].data(), row_bytes, width_pixels);
+    });
+}
+
+/**
+ * Write the input image to a 16-bit BMP file name specified, as RGB565 (BI_BITFIELDS)
+ * or RGB555 (BI_RGB). Half the size of a 24-bit file, for previews.
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param rgb565   True for 5-6-5 bits per channel, false for 5-5-5
+ * @return True if successful and false otherwise
+ */
+bool write_image_16(string filename, const vector<vector<Pixel> >& image, bool rgb565)
+{
+    // Get the image width and height in pixels
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Open a file stream for writing to a binary file
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+
+    // If there was a problem opening the file, return false
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    if (rgb565)
+    {
+        write_headers(stream, width_pixels, height_pixels, 16, {}, 3, 0, {0xF800, 0x07E0, 0x001F});
+    }
+    else
+    {
+        write_headers(stream, width_pixels, height_pixels, 16, {});
+    }
+
+    long long start = stream.tellp();
+    stream.close();
+    if (stream.fail())
+    {
+        return false;
+    }
+
+    long long width_bytes = (((long long)width_pixels * 16 + 31) / 32) * 4;
+    int green_bits = rgb565 ? 6 : 5;
+    int green_largest = (1 << green_bits) - 1;
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    return write_pixel_array(filename, start, height_pixels, width_bytes, [&](int h, unsigned char* row_bytes)
+    {
+        const Pixel* row = image[h].data();
+        for (int w = 0; w < width_pixels; w++)
+        {
+            // Round each channel to 5 (or 6) bits, treating values as bytes like the 24-bit writer
+            int red = ((unsigned char)row[w].red * 31 + 127) / 255;
+            int green = ((unsigned char)row[w].green * green_largest + 127) / 255;
+            int blue = ((unsigned char)row[w].blue * 31 + 127) / 255;
+            int value = (red << (5 + green_bits)) | (green << 5) | blue;
+            row_bytes[w * 2] = value;
+            row_bytes[w * 2 + 1] = value >> 8;
+        }
+    });
+}
+
+/**
+ * Write an 8-bit grayscale image to a BMP file name specified.
+ * The gray levels that occur form the palette, so the file uses 1, 4 or 8 bits per pixel.
+ * @param filename The BMP file name to save the image to
+ * @param image    The grayscale image to save
+ * @return True if successful and false otherwise
+ */
+bool write_gray_image(string filename, const vector<vector<unsigned char> >& image)
+{
+    // Get the image width and height in pixels
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Find the gray levels that occur with a histogram (no hashing needed for bytes)
+    vector<bool> used(256, false);
+    for (const vector<unsigned char>& row : image)
+    {
+        for (unsigned char value : row)
+        {
+            used[value] = true;
+        }
+    }
+
+    // The palette lists the levels in increasing order
+    vector<Pixel> palette;
+    unsigned char index_of[256] = {0};
+    for (int value = 0; value < 256; value++)
+    {
+        if (used[value])
+        {
+            index_of[value] = palette.size();
+            palette.push_back({value, value, value});
+        }
+    }
+
+    vector<unsigned char> indexes((size_t)width_pixels * height_pixels);
+    for (int row = 0; row < height_pixels; row++)
+    {
+        for (int col = 0; col < width_pixels; col++)
+        {
+            indexes[(size_t)row * width_pixels + col] = index_of[image[row][col]];
+        }
+    }
+    return write_indexed_image(filename, width_pixels, height_pixels, palette, indexes);
+}
+
+/**
+ * Copies a file byte for byte, letting the kernel do the work: the copy shares the
+ * source's blocks (a reflink) where the file system supports it, and otherwise
+ * copy_file_range() moves the bytes without passing them through this process.
+ * @param source      the file to copy
+ * @param destination the file to create or overwrite
+ * @param allow_link  true to make the destination a hard link to the source if possible
+ *                    (changing either file then changes both)
+ * @return True if successful and false otherwise
+ */
+bool copy_file(string source, string destination, bool allow_link)
+{
+    int input = open(source.c_str(), O_RDONLY);
+    struct stat info, existing;
+    if (input < 0 || fstat(input, &info) != 0)
+    {
+        if (input >= 0)
+        {
+            close(input);
+        }
+        return false;
+    }
+
+    // Copying a file onto itself would truncate it, and it is its own copy already
+    if (stat(destination.c_str(), &existing) == 0 && existing.st_dev == info.st_dev && existing.st_ino == info.st_ino)
+    {
+        close(input);
+        return true;
+    }
+    if (allow_link && (unlink(destination.c_str()) == 0 || errno == ENOENT) && link(source.c_str(), destination.c_str()) == 0)
+    {
+        close(input);
+        return true;
+    }
+
+    int output = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0)
+    {
+        close(input);
+        return false;
+    }
+    bool copied = false;
+#ifdef FICLONE
+    copied = ioctl(output, FICLONE, input) == 0;
+#endif
+    if (!copied)
+    {
+        // copy_file_range() fails straight away where it is not supported (such as
+        // across file systems on older kernels), and the rest is then copied by hand
+        long long remaining = info.st_size;
+        while (remaining > 0)
+        {
+            ssize_t count = copy_file_range(input, nullptr, output, nullptr, remaining, 0);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                break;
+            }
+            remaining -= count;
+        }
+
+        vector<unsigned char> buffer(1 << 20);
+        while (remaining > 0)
+        {
+            ssize_t count = read(input, buffer.data(), min((long long)buffer.size(), remaining));
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0 || write(output, buffer.data(), count) != count)
+            {
+                break;
+            }
+            remaining -= count;
+        }
+        copied = (remaining == 0);
+    }
+    close(input);
+    return close(output) == 0 && copied;
+}
+
+// Patterns of the synthetic test images: smooth ramps, random noise, a photo-like
+// texture and blocks of flat color
+const int PATTERNS = 4;
+const char* const PATTERN_NAMES[PATTERNS] = {"gradient", "noise", "texture", "flat"};
+
+/**
+ * Mixes the bits of a number so that nearby inputs give unrelated outputs
+ * (the SplitMix64 finalizer)
+ * @param value the number
+ * @return the mixed number
+ */
+unsigned long long mix_bits(unsigned long long value)
+{
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+/**
+ * Gives a pseudo-random value for a point of a grid, the same every time
+ * @param seed  the seed of the image
+ * @param x     column of the point
+ * @param y     row of the point
+ * @return a value from 0 to 255 for each of the three lowest bytes
+ */
+unsigned long long lattice_value(unsigned long long seed, long long x, long long y)
+{
+    return mix_bits(seed ^ mix_bits(((unsigned long long)y << 32) ^ (unsigned long long)x));
+}
+
+/**
+ * Adds smooth noise to the three channels of a pixel, interpolating between random
+ * values on a grid with the given spacing
+ * @param seed    the seed of the image
+ * @param spacing distance between grid points in pixels
+ * @param weight  the weight of the noise
+ * @param col     column of the pixel
+ * @param row     row of the pixel
+ * @param values  the channels, to which from 0 to 255 times the weight are added
+ * @return nothing
+ */
+void add_smooth_noise(unsigned long long seed, int spacing, double weight, int col, int row, double values[3])
+{
+    long long x = col / spacing;
+    long long y = row / spacing;
+    double fx = (double)(col % spacing) / spacing;
+    double fy = (double)(row % spacing) / spacing;
+
+    // Smoothstep weights hide the grid lines
+    fx = fx * fx * (3 - 2 * fx);
+    fy = fy * fy * (3 - 2 * fy);
+    unsigned long long corners[4] = {lattice_value(seed, x, y), lattice_value(seed, x + 1, y),
+                                     lattice_value(seed, x, y + 1), lattice_value(seed, x + 1, y + 1)};
+    for (int channel = 0; channel < 3; channel++)
+    {
+        int shift = channel * 8;
+        double top = ((corners[0] >> shift) & 0xFF) * (1 - fx) + ((corners[1] >> shift) & 0xFF) * fx;
+        double bottom = ((corners[2] >> shift) & 0xFF) * (1 - fx) + ((corners[3] >> shift) & 0xFF) * fx;
+        values[channel] += weight * (top * (1 - fy) + bottom * fy);
+    }
+}
+
+/**
+ * Fills one row of a synthetic test image. Every pixel depends only on the pattern,
+ * the seed and its position, so rows can be generated in any order.
+ * @param pattern index of the pattern in PATTERN_NAMES
+ * @param seed    the seed of the image
+ * @param width   width of the image
+ * @param height  height of the image
+ * @param row     the row, counted from the top
+ * @param pixels  set to the pixels of the row
+ * @return nothing
+ */
+void generate_row(int pattern, unsigned long long seed, int width, int height, int row, Pixel* pixels)
+{
+    for (int col = 0; col < width; col++)
+    {
+        Pixel& pixel = pixels[col];
+        if (pattern == 0)
+        {
+            pixel.red = (long long)col * 255 / max(1, width - 1);
+            pixel.green = (long long)row * 255 / max(1, height - 1);
+            pixel.blue = ((long long)col + row) * 255 / max(1, width + height - 2);
+        }
+        else if (pattern == 1)
+        {
+            unsigned long long value = lattice_value(seed, col, row);
+            pixel.red = value & 0xFF;
+            pixel.green = (value >> 8) & 0xFF;
+            pixel.blue = (value >> 16) & 0xFF;
+        }
+        else if (pattern == 2)
+        {
+            // Large shapes, finer detail and a little grain, as in a photo
+            double values[3] = {0, 0, 0};
+            add_smooth_noise(seed, 256, 0.55, col, row, values);
+            add_smooth_noise(seed + 2, 32, 0.3, col, row, values);
+            add_smooth_noise(seed + 3, 4, 0.15, col, row, values);
+            int grain = (int)(lattice_value(seed + 1, col, row) & 0xF) - 8;
+            pixel.red = min(255, max(0, (int)values[0] + grain));
+            pixel.green = min(255, max(0, (int)values[1] + grain));
+            pixel.blue = min(255, max(0, (int)values[2] + grain));
+        }
+        else
+        {
+            // Blocks of 64 pixels in one of 16 colors
+            unsigned long long color = lattice_value(seed, lattice_value(seed, col / 64, row / 64) & 0xF, 0);
+            pixel.red = color & 0xFF;
+            pixel.green = (color >> 8) & 0xFF;
+            pixel.blue = (color >> 16) & 0xFF;
+        }
+    }
+}
+
+/**
+ * Writes a synthetic 24-bit test image one band of rows at a time, so that images
+ * larger than memory can be written
+ * @param filename output BMP filename
+ * @param width    width of the image
+ * @param height   height of the image
+ * @param pattern  index of the pattern in PATTERN_NAMES
+ * @param seed     the seed, which gives different images of the same pattern
+ * @return True if successful and false otherwise
+ */
+bool write_generated_image(string filename, int width, int height, int pattern, unsigned long long seed)
+{
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    write_headers(stream, width, height, 24, {});
+    long long start = stream.tellp();
+    stream.close();
+    if (stream.fail())
+    {
+        return false;
+    }
+
+    long long width_bytes = ((long long)width * 3 + 3) / 4 * 4;
+    return write_pixel_array(filename, start, height, width_bytes, [&](int h, unsigned char* row_bytes)
+    {
+        vector<Pixel> pixels(width);
+        generate_row(pattern, seed, width, height, h, pixels.data());
+        pixels_to_bgr24(pixels.data(), row_bytes, width);
+    });
+}
+
+// Transform structure
+// A rotation, flip or transpose of the pixel grid followed by an integer enlarge
+struct Transform
+{
+    // Signed permutation matrix mapping centered input (row, col) to output (row, col)
+    int matrix[2][2];
+    // Enlarge factors applied after the permutation
+    int x_scale;
+    int y_scale;
+};
+
+/**
+ * Creates the transform that leaves an image unchanged
+ * @return the identity transform
+ */
+Transform identity_transform()
+{
+    return {{{1, 0}, {0, 1}}, 1, 1};
+}
+
+/**
+ * Creates a transform rotating by multiples of 90 degrees clockwise
+ * @param number the number of 90 degree rotations (may be negative)
+ * @return the rotation transform
+ */
+Transform rotate_transform(int number)
+{
+    Transform result = identity_transform();
+    int turns = ((number % 4) + 4) % 4;
+    for (int i = 0; i < turns; i++)
+    {
+        // A quarter turn clockwise maps (row, col) to (col, -row)
+        int row[2] = {result.matrix[1][0], result.matrix[1][1]};
+        result.matrix[1][0] = -result.matrix[0][0];
+        result.matrix[1][1] = -result.matrix[0][1];
+        result.matrix[0][0] = row[0];
+        result.matrix[0][1] = row[1];
+    }
+    return result;
+}
+
+/**
+ * Creates a transform mirroring the image left to right
+ * @return the horizontal flip transform
+ */
+Transform flip_horizontal_transform()
+{
+    return {{{1, 0}, {0, -1}}, 1, 1};
+}
+
+/**
+ * Creates a transform mirroring the image top to bottom
+ * @return the vertical flip transform
+ */
+Transform flip_vertical_transform()
+{
+    return {{{-1, 0}, {0, 1}}, 1, 1};
+}
+
+/**
+ * Creates a transform swapping rows and columns
+ * @return the transpose transform
+ */
+Transform transpose_transform()
+{
+    return {{{0, 1}, {1, 0}}, 1, 1};
+}
+
+/**
+ * Creates a transform enlarging the image by integer factors
+ * @param x_scale horizontal enlarge factor
+ * @param y_scale vertical enlarge factor
+ * @return the enlarge transform
+ */
+Transform enlarge_transform(int x_scale, int y_scale)
+{
+    return {{{1, 0}, {0, 1}}, x_scale, y_scale};
+}
+
+/**
+ * Combines two transforms into one that has the effect of applying both
+ * @param first  the transform applied first
+ * @param second the transform applied second
+ * @return the composed transform
+ */
+Transform compose_transforms(const Transform& first, const Transform& second)
+{
+    Transform result;
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            result.matrix[i][j] = second.matrix[i][0] * first.matrix[0][j] + second.matrix[i][1] * first.matrix[1][j];
+        }
+    }
+
+    // The first enlarge moves past the second permutation, swapping axes if it transposes
+    bool swapped = (second.matrix[0][0] == 0);
+    result.x_scale = (swapped ? first.y_scale : first.x_scale) * second.x_scale;
+    result.y_scale = (swapped ? first.x_scale : first.y_scale) * second.y_scale;
+    return result;
+}
+
+/**
+ * Copies one row of pixels, optionally reversed and with each pixel repeated.
+ * Helper function for apply_transform()
+ * @param source  the first pixel of the source row
+ * @param dest    the first pixel of the destination row
+ * @param width   number of source pixels
+ * @param reverse true to copy the pixels right to left
+ * @param x_scale number of times each pixel is repeated
+ * @return nothing
+ */
+template <typename T>
+void copy_row(const T* source, T* dest, int width, bool reverse, int x_scale)
+{
+    if (x_scale == 1)
+    {
+        if (reverse)
+        {
+            reverse_copy(source, source + width, dest);
+        }
+        else
+        {
+            copy(source, source + width, dest);
+        }
+        return;
+    }
+
+    for (int col = 0; col < width; col++)
+    {
+        const T& pixel = source[reverse ? width - 1 - col : col];
+        fill(dest + col * x_scale, dest + (col + 1) * x_scale, pixel);
+    }
+}
+
+/**
+ * Applies a transform to an image in a single pass, picking a kernel for its shape:
+ * row copies (plain, reversed or replicated) when rows stay rows, otherwise a tiled
+ * transpose. Enlarged rows are built once and then duplicated.
+ * Works for color images and for 8-bit grayscale images.
+ * @param image     the input image
+ * @param transform the transform to apply
+ * @return the transformed image
+ */
+template <typename T>
+vector<vector<T> > apply_transform(const vector<vector<T> >& image, const Transform& transform)
+{
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Transposing transforms exchange the width and height
+    bool swapped = (transform.matrix[0][0] == 0);
+    int base_width = swapped ? height_pixels : width_pixels;
+    int base_height = swapped ? width_pixels : height_pixels;
+    int x_scale = transform.x_scale;
+    int y_scale = transform.y_scale;
+
+    // Define a new 2D vector the size of the transformed image
+    vector<vector<T> > new_image(base_height * y_scale, vector<T> (base_width * x_scale));
+
+    if (!swapped) {
+        // Rows stay rows, possibly in reverse order and reversed themselves
+        bool reverse_rows = (transform.matrix[0][0] < 0);
+        bool reverse_cols = (transform.matrix[1][1] < 0);
+        for (int row = 0; row < base_height; row++) {
+            allow_preemption(row);
+            int source_row = reverse_rows ? height_pixels - 1 - row : row;
+            copy_row(image[source_row].data(), new_image[row * y_scale].data(), width_pixels, reverse_cols, x_scale);
+        }
+    } else {
+        // Output rows come from source columns; work in tiles so both sides stay in cache
+        const int TILE = 64;
+        bool reverse_source_cols = (transform.matrix[0][1] < 0);
+        bool reverse_source_rows = (transform.matrix[1][0] < 0);
+        for (int row_start = 0; row_start < base_height; row_start += TILE) {
+            allow_preemption(row_start);
+            int row_end = min(row_start + TILE, base_height);
+            for (int col_start = 0; col_start < base_width; col_start += TILE) {
+                int col_end = min(col_start + TILE, base_width);
+                for (int row = row_start; row < row_end; row++) {
+                    int source_col = reverse_source_cols ? width_pixels - 1 - row : row;
+                    T* out = new_image[row * y_scale].data();
+                    for (int col = col_start; col < col_end; col++) {
+                        int source_row = reverse_source_rows ? height_pixels - 1 - col : col;
+                        fill(out + col * x_scale, out + (col + 1) * x_scale, image[source_row][source_col]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Duplicate each finished row to fill in the vertical enlarge
+    for (int row = 0; row < base_height; row++) {
+        allow_preemption(row);
+        for (int copy_index = 1; copy_index < y_scale; copy_index++) {
+            new_image[row * y_scale + copy_index] = new_image[row * y_scale];
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Mirrors an image left to right in place.
+ * Works for color images and for 8-bit grayscale images.
+ * @param image the image to flip
+ * @return nothing
+ */
+template <typename T>
+void flip_horizontal(vector<vector<T> >& image)
+{
+    for (vector<T>& row : image)
+    {
+        reverse(row.begin(), row.end());
+    }
+}
+
+/**
+ * Mirrors an image top to bottom in place.
+ * Each row is its own vector, so this only swaps row buffers and never moves pixels.
+ * Works for color images and for 8-bit grayscale images.
+ * @param image the image to flip
+ * @return nothing
+ */
+template <typename T>
+void flip_vertical(vector<vector<T> >& image)
+{
+    for (int top = 0, bottom = image.size() - 1; top < bottom; top++, bottom--)
+    {
+        image[top].swap(image[bottom]);
+    }
+}
+
+/**
+ * Composes a sequence of transforms and applies the result in a single pass
+ * @param image      the input image
+ * @param transforms the transforms in the order they should be applied
+ * @return the transformed image
+ */
+template <typename T>
+vector<vector<T> > apply_transforms(const vector<vector<T> >& image, const vector<Transform>& transforms)
+{
+    Transform combined = identity_transform();
+    for (const Transform& transform : transforms)
+    {
+        combined = compose_transforms(combined, transform);
+    }
+    return apply_transform(image, combined);
+}
+
+
+/**
+ * Applies the vignette of process_1() to one row of an image
+ * (or to part of a row, such as the width of one tile)
+ * @param row_pixels    the input row
+ * @param new_row       the output row (same width as the input row)
+ * @param row           index of the row in the image
+ * @param first_col     index in the image of the first column of the row
+ * @param width_pixels  width of the image
+ * @param height_pixels height of the image
+ * @return nothing
+ */
+void vignette_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row, int row, int first_col, int width_pixels, int height_pixels)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        double distance = sqrt(pow((first_col + col - width_pixels/2), 2) + pow((row - height_pixels/2), 2));
+        double scaling_factor = (height_pixels - distance)/height_pixels;
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = red * scaling_factor;
+        new_row[col].green = green * scaling_factor;
+        new_row[col].blue = blue * scaling_factor;
+    }
+}
+
+vector<vector<Pixel> > process_1(const vector<vector<Pixel> >& image)
+// Adds vignette effect to image (dark corners)
+// read in an image, process the pixel values using Process 1, and write the result out to a new image file.
+{
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            vignette_row(image[row], new_image[row], row, 0, width_pixels, height_pixels);
+        }
+    });
+        
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Applies the Clarendon effect of process_2() to one row of an image
+ * @param row_pixels     the input row
+ * @param new_row        the output row (same width as the input row, or the input row itself)
+ * @param scaling_factor how much darker the darks and lighter the lights get
+ * @return nothing
+ */
+void clarendon_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row, double scaling_factor)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        // Perform the operation on the color values (refer to Runestone for this)
         double average_value = (red + green + blue)/3;
         int new_red, new_green, new_blue;
 
-        
-        if (average_value >= 170) {
-            new_red = 255 - (255 - red) * scaling_factor;
-            new_green = 255 - (255 - green) * scaling_factor;
-            new_blue = 255 - (255 - blue) * scaling_factor;
-        } else if (average_value < 90) {
-            new_red = red * scaling_factor;
-            new_green = green * scaling_factor;
-            new_blue = blue * scaling_factor;
-        } else {
-            new_red = red;
-            new_green = green;
-            new_blue = blue;
+        if (average_value >= 170) {
+            new_red = 255 - (255 - red) * scaling_factor;
+            new_green = 255 - (255 - green) * scaling_factor;
+            new_blue = 255 - (255 - blue) * scaling_factor;
+        } else if (average_value < 90) {
+            new_red = red * scaling_factor;
+            new_green = green * scaling_factor;
+            new_blue = blue * scaling_factor;
+        } else {
+            new_red = red;
+            new_green = green;
+            new_blue = blue;
+        }
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = new_red;
+        new_row[col].green = new_green;
+        new_row[col].blue = new_blue;
+    }
+}
+
+vector<vector<Pixel> > process_2(const vector<vector<Pixel> >& image, double scaling_factor) {
+    // Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            clarendon_row(image[row], new_image[row], scaling_factor);
+        }
+    });
+
+    // Return the new 2D vector
+    return new_image;
+
+}
+
+/**
+ * Applies the grayscale of process_3() to one row of an image
+ * @param row_pixels the input row
+ * @param new_row    the output row (same width as the input row, or the input row itself)
+ * @return nothing
+ */
+void grayscale_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        // To round a positive floating-point value to the nearest integer, 
+        // add 0.5 and then convert to an integer. (For a negative value, you subtract 0.5.)
+        int gray_value = ((red + green + blue)/3) + 0.5;
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = gray_value; 
+        new_row[col].green = gray_value;
+        new_row[col].blue = gray_value;
+    }
+}
+
+vector<vector<Pixel> > process_3(const vector<vector<Pixel> >& image) {
+    // Grayscale image
+    
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            grayscale_row(image[row], new_image[row]);
+        }
+    });
+
+    // Return the new 2D vector
+    return new_image;
+
+}
+
+vector<vector<Pixel> > process_4(const vector<vector<Pixel> >& image){
+    // Rotates image by 90 degrees clockwise (not counter-clockwise)
+    return apply_transform(image, rotate_transform(1));
+}
+
+vector<vector<Pixel> > process_5(const vector<vector<Pixel> >& image, int number) {
+    // Rotates image by a specified number of multiples of 90 degrees clockwise
+    // The rotations are combined into a single transform, so any number costs one pass
+    if (((number % 4) + 4) % 4 == 0) {
+        return image;
+    }
+    return apply_transform(image, rotate_transform(number));
+}
+
+vector<vector<Pixel> > process_6(const vector<vector<Pixel> >& image, int x_scale, int y_scale){
+    // Enlarges the image in the x and y direction
+    if (x_scale < 1 || y_scale < 1) {
+        cout << "scale must be at least 1. Please enter a valid scale." << endl;
+        return image;
+    }
+    return apply_transform(image, enlarge_transform(x_scale, y_scale));
+}
+
+/**
+ * Applies the high contrast of process_7() to one row of an image
+ * @param row_pixels the input row
+ * @param new_row    the output row (same width as the input row, or the input row itself)
+ * @return nothing
+ */
+void high_contrast_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        // Perform the operation on the color values (refer to Runestone for this)
+        int gray_value = (red + green + blue)/3;
+        int new_red, new_green, new_blue;
+
+        if (gray_value >= 255/2) {
+            new_red = 255;
+            new_green = 255;
+            new_blue = 255;
+        } else {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 0;
+        }
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = new_red;
+        new_row[col].green = new_green;
+        new_row[col].blue = new_blue;
+    }
+}
+
+vector<vector<Pixel> > process_7(const vector<vector<Pixel> >& image) {
+    // Convert image to high contrast (black and white only)
+    
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            high_contrast_row(image[row], new_image[row]);
+        }
+    });
+        
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Applies the lightening of process_8() to one row of an image
+ * @param row_pixels     the input row
+ * @param new_row        the output row (same width as the input row, or the input row itself)
+ * @param scaling_factor how much of the distance to white remains
+ * @return nothing
+ */
+void lighten_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row, double scaling_factor)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = 255 - (255 - red) * scaling_factor;
+        new_row[col].green = 255 - (255 - green) * scaling_factor;
+        new_row[col].blue = 255 - (255 - blue) * scaling_factor;
+    }
+}
+
+vector<vector<Pixel> > process_8(const vector<vector<Pixel> >& image, double scaling_factor) {
+    // Lightens image by a scaling factor
+    
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            lighten_row(image[row], new_image[row], scaling_factor);
+        }
+    });
+        
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Applies the darkening of process_9() to one row of an image
+ * @param row_pixels     the input row
+ * @param new_row        the output row (same width as the input row, or the input row itself)
+ * @param scaling_factor how much of each color value remains
+ * @return nothing
+ */
+void darken_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row, double scaling_factor)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = red * scaling_factor;
+        new_row[col].green = green * scaling_factor;
+        new_row[col].blue = blue * scaling_factor;
+    }
+}
+
+vector<vector<Pixel> > process_9(const vector<vector<Pixel> >& image, double scaling_factor) {
+    // Darkens image by a scaling factor
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            darken_row(image[row], new_image[row], scaling_factor);
+        }
+    });
+        
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Applies the black, white, red, blue and green palette of process_10() to one row of an image
+ * @param row_pixels the input row
+ * @param new_row    the output row (same width as the input row, or the input row itself)
+ * @return nothing
+ */
+void primary_colors_row(const vector<Pixel>& row_pixels, vector<Pixel>& new_row)
+{
+    int count = row_pixels.size();
+    for (int col = 0; col < count; col++) { // width (a.k.a. number of columns)
+
+        // Get the color values for a single pixel in the input row
+        int red = row_pixels[col].red;
+        int green = row_pixels[col].green;
+        int blue = row_pixels[col].blue;
+
+        // Perform the operation on the color values
+        int max_color = max(max(red, green), blue);
+        int new_red, new_green, new_blue;
+
+        if (red + green + blue >= 550) {
+            new_red = 255;
+            new_green = 255;
+            new_blue = 255;
+        } else if (red + green + blue <= 150) {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 0;
+        } else if (max_color == red) {
+            new_red = 255;
+            new_green = 0;
+            new_blue = 0;
+        } else if (max_color == green) {
+            new_red = 0;
+            new_green = 255;
+            new_blue = 0;
+        } else {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 255;
+        }
+
+        // Save the new color values to the corresponding pixel in the new row
+        new_row[col].red = new_red;
+        new_row[col].green = new_green;
+        new_row[col].blue = new_blue;
+    }
+}
+
+vector<vector<Pixel> > process_10(const vector<vector<Pixel> >& image) {
+    // Converts image to only black, white, red, blue, and green
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    // Iterate through bands of rows of the input 2D vector on separate threads
+    parallel_for_rows(height_pixels, [&](int first, int last) {
+        for (int row = first; row < last; row++) { // height (a.k.a. number of rows)
+            primary_colors_row(image[row], new_image[row]);
+        }
+    });
+        
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Narrows a span of columns to those where a linear coordinate stays in range.
+ * Helper function for process_11()
+ * @param start first coordinate of the span (16.16 fixed point)
+ * @param step  coordinate increment per column (16.16 fixed point)
+ * @param limit largest allowed coordinate (16.16 fixed point), the smallest is 0
+ * @param first first column of the span, updated in place
+ * @param last  last column of the span, updated in place
+ * @return nothing
+ */
+void clip_span(long long start, long long step, long long limit, int& first, int& last)
+{
+    if (step == 0)
+    {
+        // The coordinate is constant along the row, so it is either always in range or never
+        if (start < 0 || start > limit)
+        {
+            last = first - 1;
+        }
+        return;
+    }
+
+    // Solve 0 <= start + step * col <= limit for col
+    double low = (0.0 - start) / step;
+    double high = (double)(limit - start) / step;
+    if (step < 0)
+    {
+        swap(low, high);
+    }
+    if (low > first)
+    {
+        first = (int)min(ceil(low), (double)last + 1);
+    }
+    if (high < last)
+    {
+        last = (int)max(floor(high), (double)first - 1);
+    }
+
+    // Correct the rounding of the analytic solution against the exact fixed point values
+    while (first <= last && (start + step * first < 0 || start + step * first > limit))
+    {
+        first++;
+    }
+    while (first <= last && (start + step * last < 0 || start + step * last > limit))
+    {
+        last--;
+    }
+}
+
+/**
+ * Computes the size of the canvas for an image rotated by process_11()
+ * (the small epsilon absorbs rounding at multiples of 90 degrees)
+ * @param width      width of the image
+ * @param height     height of the image
+ * @param angle      the angle in degrees
+ * @param expand     true if the canvas grows to fit the whole rotated image
+ * @param new_width  set to the width of the canvas
+ * @param new_height set to the height of the canvas
+ * @return nothing
+ */
+void rotated_size(int width, int height, double angle, bool expand, int& new_width, int& new_height)
+{
+    new_width = width;
+    new_height = height;
+    if (expand)
+    {
+        double radians = angle * M_PI / 180.0;
+        new_width = ceil(width * fabs(cos(radians)) + height * fabs(sin(radians)) - 1e-6);
+        new_height = ceil(width * fabs(sin(radians)) + height * fabs(cos(radians)) - 1e-6);
+    }
+}
+
+vector<vector<Pixel> > process_11(const vector<vector<Pixel> >& image, double angle, bool expand) {
+    // Rotates image by an arbitrary angle (in degrees) clockwise using bilinear sampling
+    // If expand is true the canvas grows to fit the whole rotated image, otherwise it is cropped
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Quarter turns that keep the whole image on the canvas are exact permutations
+    if (fmod(angle, 90.0) == 0 && (expand || width_pixels == height_pixels)) {
+        return apply_transform(image, rotate_transform((int)fmod(angle / 90.0, 4.0)));
+    }
+
+    double radians = angle * M_PI / 180.0;
+    double cos_angle = cos(radians);
+    double sin_angle = sin(radians);
+    int new_width, new_height;
+    rotated_size(width_pixels, height_pixels, angle, expand, new_width, new_height);
+
+    // Define a new 2D vector for the rotated image (pixels outside the source stay black)
+    vector<vector<Pixel> > new_image(new_height, vector<Pixel> (new_width));
+
+    // Centers of the input and output images
+    double center_x = (width_pixels - 1) / 2.0;
+    double center_y = (height_pixels - 1) / 2.0;
+    double new_center_x = (new_width - 1) / 2.0;
+    double new_center_y = (new_height - 1) / 2.0;
+
+    // Source coordinates advance by a constant step along each output row (16.16 fixed point)
+    const double ONE = 65536.0;
+    long long step_x = llround(cos_angle * ONE);
+    long long step_y = llround(-sin_angle * ONE);
+    long long limit_x = (long long)(width_pixels - 1) << 16;
+    long long limit_y = (long long)(height_pixels - 1) << 16;
+
+    for (int row = 0; row < new_height; row++) { // height (a.k.a. number of rows)
+        allow_preemption(row);
+
+        // Source coordinates of the first pixel in this output row
+        long long start_x = llround((center_x - new_center_x * cos_angle + (row - new_center_y) * sin_angle) * ONE);
+        long long start_y = llround((center_y + new_center_x * sin_angle + (row - new_center_y) * cos_angle) * ONE);
+
+        // Only the columns that land inside the source image need any work
+        int first = 0;
+        int last = new_width - 1;
+        clip_span(start_x, step_x, limit_x, first, last);
+        clip_span(start_y, step_y, limit_y, first, last);
+
+        long long source_x = start_x + step_x * first;
+        long long source_y = start_y + step_y * first;
+        Pixel* out = new_image[row].data();
+
+        for (int col = first; col <= last; col++) { // width (a.k.a. number of columns)
+
+            // Integer source position and 8-bit interpolation weights
+            int x0 = source_x >> 16;
+            int y0 = source_y >> 16;
+            int fx = (source_x >> 8) & 0xFF;
+            int fy = (source_y >> 8) & 0xFF;
+
+            // Neighbours to the right and below (clamped at the last row/column)
+            int x1 = x0 + (x0 < width_pixels - 1);
+            const Pixel* top = image[y0].data();
+            const Pixel* bottom = image[y0 + (y0 < height_pixels - 1)].data();
+
+            // Blend horizontally and then vertically
+            int top_red = top[x0].red * (256 - fx) + top[x1].red * fx;
+            int top_green = top[x0].green * (256 - fx) + top[x1].green * fx;
+            int top_blue = top[x0].blue * (256 - fx) + top[x1].blue * fx;
+            int bottom_red = bottom[x0].red * (256 - fx) + bottom[x1].red * fx;
+            int bottom_green = bottom[x0].green * (256 - fx) + bottom[x1].green * fx;
+            int bottom_blue = bottom[x0].blue * (256 - fx) + bottom[x1].blue * fx;
+
+            // Save the new color values to the corresponding pixel in the new 2D vector
+            out[col].red = (top_red * (256 - fy) + bottom_red * fy + 32768) >> 16;
+            out[col].green = (top_green * (256 - fy) + bottom_green * fy + 32768) >> 16;
+            out[col].blue = (top_blue * (256 - fy) + bottom_blue * fy + 32768) >> 16;
+
+            source_x += step_x;
+            source_y += step_y;
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+vector<vector<Pixel> > process_12(const vector<vector<Pixel> >& image, int number, int x_scale, int y_scale) {
+    // Rotates image by multiples of 90 degrees clockwise and then enlarges it
+    // Both steps are composed into one transform so the image is only traversed once
+    if (x_scale < 1 || y_scale < 1) {
+        cout << "scale must be at least 1. Please enter a valid scale." << endl;
+        return image;
+    }
+    return apply_transforms(image, {rotate_transform(number), enlarge_transform(x_scale, y_scale)});
+}
+
+vector<vector<Pixel> > process_13(const vector<vector<Pixel> >& image) {
+    // Mirrors image left to right
+    return apply_transform(image, flip_horizontal_transform());
+}
+
+vector<vector<Pixel> > process_14(const vector<vector<Pixel> >& image) {
+    // Mirrors image top to bottom
+    return apply_transform(image, flip_vertical_transform());
+}
+
+vector<vector<unsigned char> > gray_image(const vector<vector<Pixel> >& image) {
+    // Grayscale image with one byte per pixel (the same gray values as process_3)
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector of gray values the same size as the input 2D vector
+    vector<vector<unsigned char> > new_image(height_pixels, vector<unsigned char> (width_pixels));
+
+    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows)
+        allow_preemption(row);
+        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+            const Pixel& pixel = image[row][col];
+            new_image[row][col] = (pixel.red + pixel.green + pixel.blue) / 3;
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+vector<vector<Pixel> > color_image(const vector<vector<unsigned char> >& image) {
+    // Expands a grayscale image back to red, green and blue values
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+
+    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows)
+        allow_preemption(row);
+        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+            int gray_value = image[row][col];
+            new_image[row][col].red = gray_value;
+            new_image[row][col].green = gray_value;
+            new_image[row][col].blue = gray_value;
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+vector<vector<unsigned char> > process_7(const vector<vector<unsigned char> >& image) {
+    // Convert grayscale image to high contrast (black and white only)
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<unsigned char> > new_image(height_pixels, vector<unsigned char> (width_pixels));
+
+    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows)
+        allow_preemption(row);
+        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+            new_image[row][col] = (image[row][col] >= 255/2) ? 255 : 0;
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+vector<vector<unsigned char> > process_8(const vector<vector<unsigned char> >& image, double scaling_factor) {
+    // Lightens grayscale image by a scaling factor (between 0 and 1)
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<unsigned char> > new_image(height_pixels, vector<unsigned char> (width_pixels));
+
+    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows)
+        allow_preemption(row);
+        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+            int new_gray = 255 - (255 - image[row][col]) * scaling_factor;
+            new_image[row][col] = new_gray;
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+vector<vector<unsigned char> > process_9(const vector<vector<unsigned char> >& image, double scaling_factor) {
+    // Darkens grayscale image by a scaling factor (between 0 and 1)
+
+    // Get the number of rows/columns from the input 2D vector
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<unsigned char> > new_image(height_pixels, vector<unsigned char> (width_pixels));
+
+    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows)
+        allow_preemption(row);
+        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+            int new_gray = image[row][col] * scaling_factor;
+            new_image[row][col] = new_gray;
+        }
+    }
+
+    // Return the new 2D vector
+    return new_image;
+}
+
+/**
+ * Checks whether a filter can run on a grayscale image and give the same result
+ * as on the equivalent color image
+ * @param choice the menu number of the filter
+ * @param value1 first filter parameter
+ * @param value2 second filter parameter
+ * @param value3 third filter parameter
+ * @return True if apply_gray_filter() supports the filter with these parameters
+ */
+bool gray_filter_supported(int choice, double value1, double value2, double value3)
+{
+    switch (choice) {
+        case 3: case 4: case 5: case 7: case 13: case 14: return true;
+        case 6: return value1 >= 1 && value2 >= 1;
+        case 12: return value2 >= 1 && value3 >= 1;
+        // Factors outside [0, 1] leave the 0-255 range, which one byte cannot hold
+        case 8: case 9: return value1 >= 0 && value1 <= 1;
+        default: return false;
+    }
+}
+
+/**
+ * Applies the filter with the given menu number to a grayscale image.
+ * Only filters accepted by gray_filter_supported() may be used.
+ * @param choice the menu number of the filter
+ * @param image  the grayscale input image
+ * @param value1 first filter parameter
+ * @param value2 second filter parameter
+ * @param value3 third filter parameter
+ * @return the filtered grayscale image
+ */
+vector<vector<unsigned char> > apply_gray_filter(int choice, const vector<vector<unsigned char> >& image, double value1, double value2, double value3)
+{
+    switch (choice) {
+        case 4: return apply_transform(image, rotate_transform(1));
+        case 5: return apply_transform(image, rotate_transform((int)value1));
+        case 6: return apply_transform(image, enlarge_transform((int)value1, (int)value2));
+        case 7: return process_7(image);
+        case 8: return process_8(image, value1);
+        case 9: return process_9(image, value1);
+        case 12: return apply_transforms(image, {rotate_transform((int)value1), enlarge_transform((int)value2, (int)value3)});
+        case 13: return apply_transform(image, flip_horizontal_transform());
+        case 14: return apply_transform(image, flip_vertical_transform());
+        default: return image;
+    }
+}
+
+/**
+ * Applies the filter with the given menu number to an image
+ * @param choice the menu number of the filter (1-14)
+ * @param image  the input image
+ * @param value1 first filter parameter (scaling factor, rotations, X scale or angle)
+ * @param value2 second filter parameter (Y scale, or non-zero to expand a rotation)
+ * @param value3 third filter parameter (Y scale of filter 12)
+ * @return the filtered image, or an empty vector for an unknown filter
+ */
+vector<vector<Pixel> > apply_filter(int choice, const vector<vector<Pixel> >& image, double value1, double value2, double value3)
+{
+    switch (choice) {
+        case 1: return process_1(image);
+        case 2: return process_2(image, value1);
+        case 3: return process_3(image);
+        case 4: return process_4(image);
+        case 5: return process_5(image, (int)value1);
+        case 6: return process_6(image, (int)value1, (int)value2);
+        case 7: return process_7(image);
+        case 8: return process_8(image, value1);
+        case 9: return process_9(image, value1);
+        case 10: return process_10(image);
+        case 11: return process_11(image, value1, value2 != 0);
+        case 12: return process_12(image, (int)value1, (int)value2, (int)value3);
+        case 13: return process_13(image);
+        case 14: return process_14(image);
+        default: return {};
+    }
+}
+
+// Step structure
+// One filter of a chain and its parameters
+struct Step
+{
+    // Menu number of the filter
+    int choice;
+    // Filter parameters (unused ones are 0)
+    double value1;
+    double value2;
+    double value3;
+};
+
+/**
+ * Parses a whole string as an integer
+ * @param text  the text to parse
+ * @param value set to the integer
+ * @return True if all of text is an integer that fits an int and false otherwise
+ */
+bool parse_number(const string& text, int& value)
+{
+    char* end = nullptr;
+    errno = 0;
+    long parsed = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX)
+    {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+/**
+ * Parses a whole string as an unsigned 64-bit integer
+ * @param text  the text to parse
+ * @param value set to the integer
+ * @return True if all of text is an integer from 0 to 2^64 - 1 and false otherwise
+ */
+bool parse_number(const string& text, unsigned long long& value)
+{
+    char* end = nullptr;
+    errno = 0;
+    // strtoull() would wrap a minus sign around instead of refusing it
+    unsigned long long parsed = strtoull(text.c_str(), &end, 10);
+    if (text.empty() || text.find('-') != string::npos || *end != '\0' || errno == ERANGE)
+    {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+/**
+ * Parses a whole string as a finite number
+ * @param text  the text to parse
+ * @param value set to the number
+ * @return True if all of text is a finite number and false otherwise
+ */
+bool parse_number(const string& text, double& value)
+{
+    char* end = nullptr;
+    double parsed = strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0' || !std::isfinite(parsed))
+    {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+/**
+ * Parses a chain step written as FILTER or FILTER:VALUE1[,VALUE2[,VALUE3]]
+ * @param text the step as given on the command line
+ * @param step set to the step
+ * @return True if the step is well formed and false otherwise
+ */
+bool parse_step(const string& text, Step& step)
+{
+    step = {0, 0, 0, 0};
+    size_t colon = text.find(':');
+    if (!parse_number(text.substr(0, colon), step.choice)) {
+        return false;
+    }
+    if (colon != string::npos) {
+        double* values[3] = {&step.value1, &step.value2, &step.value3};
+        size_t start = colon + 1;
+        for (int i = 0; i < 3 && start <= text.size(); i++) {
+            size_t comma = text.find(',', start);
+            if (!parse_number(text.substr(start, comma - start), *values[i])) {
+                return false;
+            }
+            start = (comma == string::npos) ? text.size() + 1 : comma + 1;
+        }
+        // More than three values is as malformed as a value that is not a number
+        if (start <= text.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Gives the transform of a filter that only moves pixels around
+ * @param step      the filter and its parameters
+ * @param width     width of the image the filter is applied to
+ * @param height    height of the image the filter is applied to
+ * @param transform set to the filter's transform
+ * @return True if the filter is a transform and false otherwise
+ */
+bool step_transform(const Step& step, int width, int height, Transform& transform)
+{
+    switch (step.choice) {
+        case 4: transform = rotate_transform(1); return true;
+        case 5: transform = rotate_transform((int)step.value1); return true;
+        case 6: transform = enlarge_transform((int)step.value1, (int)step.value2); return true;
+        case 12: transform = compose_transforms(rotate_transform((int)step.value1), enlarge_transform((int)step.value2, (int)step.value3)); return true;
+        case 13: transform = flip_horizontal_transform(); return true;
+        case 14: transform = flip_vertical_transform(); return true;
+        case 11:
+            // Only quarter turns that keep the whole image on the canvas
+            if (fmod(step.value1, 90.0) == 0 && (step.value2 != 0 || width == height)) {
+                transform = rotate_transform((int)fmod(step.value1 / 90.0, 4.0));
+                return true;
+            }
+            return false;
+        default: return false;
+    }
+}
+
+/**
+ * Checks whether a chain of filters leaves the image exactly as it is: each filter
+ * has a neutral factor of 1 or only moves pixels, and together the moves cancel out
+ * @param steps the filters in the order they are applied
+ * @return True if the output would have the same pixels as the input
+ */
+bool is_identity_chain(const vector<Step>& steps)
+{
+    Transform combined = identity_transform();
+    Transform transform;
+    for (const Step& step : steps) {
+        if ((step.choice == 2 || step.choice == 8 || step.choice == 9) && step.value1 == 1) {
+            continue;
+        }
+
+        // Invalid scales are left to the filters to report, and quarter turns by
+        // filter 11 only count when expanding (the image size is not known here)
+        bool valid_scale = (step.choice != 6 || (step.value1 >= 1 && step.value2 >= 1)) &&
+                           (step.choice != 12 || (step.value2 >= 1 && step.value3 >= 1));
+        if (!valid_scale || !step_transform(step, 0, 1, transform)) {
+            return false;
+        }
+        combined = compose_transforms(combined, transform);
+    }
+
+    Transform identity = identity_transform();
+    return memcmp(combined.matrix, identity.matrix, sizeof(identity.matrix)) == 0 &&
+           combined.x_scale == 1 && combined.y_scale == 1;
+}
+
+/**
+ * Produces the output of a chain of filters that changes nothing by copying the
+ * input file, without decoding or encoding any pixels
+ * @param input  the input BMP filename
+ * @param output the output BMP filename
+ * @param steps  the filters in the order they are applied
+ * @return True if the chain is an identity and the input was copied
+ */
+bool copy_identity(string input, string output, const vector<Step>& steps)
+{
+    // The headers are still checked, so invalid inputs fail the way they otherwise would
+    RowReader reader;
+    return is_identity_chain(steps) && open_row_reader(reader, input) && copy_file(input, output, false);
+}
+
+/**
+ * Applies a sequence of filters to an image and writes the result.
+ * After grayscale (filter 3) the image is kept at one byte per pixel for as long
+ * as the following filters support it, and is written as a grayscale BMP.
+ * @param input         the input BMP filename
+ * @param output        the output BMP filename
+ * @param steps         the filters in the order they are applied
+ * @param report_memory true to print the allocations of the decode, each filter and the encode
+ * @return True if successful and false otherwise
+ */
+bool run_chain(string input, string output, const vector<Step>& steps, bool report_memory)
+{
+    if (copy_identity(input, output, steps)) {
+        if (report_memory) {
+            cout << "  copied, the filters change nothing" << endl;
+        }
+        return true;
+    }
+
+    AllocationStats stats;
+    begin_allocations(stats);
+    vector<vector<Pixel> > image = read_image(input);
+    if (image.empty()) {
+        cout << input << ": could not read image" << endl;
+        return false;
+    }
+    end_allocations(stats);
+    if (report_memory) {
+        print_allocations("decode", stats);
+    }
+
+    vector<vector<unsigned char> > gray;
+    bool is_gray = false;
+    for (const Step& step : steps) {
+        begin_allocations(stats);
+        if (step.choice == 13 || step.choice == 14) {
+            // Flips work in place on whichever image is current
+            if (step.choice == 13) {
+                is_gray ? flip_horizontal(gray) : flip_horizontal(image);
+            } else {
+                is_gray ? flip_vertical(gray) : flip_vertical(image);
+            }
+        } else if (is_gray && gray_filter_supported(step.choice, step.value1, step.value2, step.value3)) {
+            gray = apply_gray_filter(step.choice, gray, step.value1, step.value2, step.value3);
+        } else if (step.choice == 3) {
+            gray = gray_image(image);
+            image.clear();
+            is_gray = true;
+        } else {
+            // The next filter needs color values again
+            if (is_gray) {
+                image = color_image(gray);
+                gray.clear();
+                is_gray = false;
+            }
+            image = apply_filter(step.choice, image, step.value1, step.value2, step.value3);
+            if (image.empty()) {
+                cout << "Unknown filter " << step.choice << endl;
+                return false;
+            }
+        }
+        end_allocations(stats);
+        if (report_memory) {
+            print_allocations("filter " + to_string(step.choice), stats);
+        }
+    }
+
+    begin_allocations(stats);
+    bool written = is_gray ? write_gray_image(output, gray) : write_image(output, image);
+    if (!written) {
+        cout << output << ": could not write image" << endl;
+    }
+    end_allocations(stats);
+    if (report_memory) {
+        print_allocations("encode", stats);
+    }
+    return written;
+}
+
+/**
+ * Checks whether a filter computes each output row from the same input row only
+ * @param choice the menu number of the filter
+ * @return True if the filter can be applied one row at a time
+ */
+bool is_point_filter(int choice)
+{
+    switch (choice) {
+        case 1: case 2: case 3: case 7: case 8: case 9: case 10: case 13: return true;
+        default: return false;
+    }
+}
+
+/**
+ * Applies a point filter to one row of an image in place
+ * (or to part of a row, such as the width of one tile; a horizontal flip reverses
+ * only the part it is given)
+ * @param step          the filter and its parameters (a point filter)
+ * @param row_pixels    the row, replaced by the filtered row
+ * @param row           index of the row in the image
+ * @param first_col     index in the image of the first column of the row
+ * @param width_pixels  width of the image
+ * @param height_pixels height of the image
+ * @return nothing
+ */
+void point_filter_row(const Step& step, vector<Pixel>& row_pixels, int row, int first_col, int width_pixels, int height_pixels)
+{
+    switch (step.choice) {
+        case 1: vignette_row(row_pixels, row_pixels, row, first_col, width_pixels, height_pixels); break;
+        case 2: clarendon_row(row_pixels, row_pixels, step.value1); break;
+        case 3: grayscale_row(row_pixels, row_pixels); break;
+        case 7: high_contrast_row(row_pixels, row_pixels); break;
+        case 8: lighten_row(row_pixels, row_pixels, step.value1); break;
+        case 9: darken_row(row_pixels, row_pixels, step.value1); break;
+        case 10: primary_colors_row(row_pixels, row_pixels); break;
+        case 13: reverse(row_pixels.begin(), row_pixels.end()); break;
+        default: break;
+    }
+}
+
+/**
+ * Applies a chain of row-by-row filters to a BMP file while streaming it from the
+ * input to the output, so only a single row is ever held in memory. The result is
+ * written as a 24-bit BMP.
+ * @param input  the input BMP filename
+ * @param output the output BMP filename
+ * @param steps  the filters in the order they are applied (point filters only)
+ * @return True if successful and false otherwise
+ */
+bool run_stream(string input, string output, const vector<Step>& steps)
+{
+    if (copy_identity(input, output, steps)) {
+        return true;
+    }
+    for (const Step& step : steps) {
+        if (!is_point_filter(step.choice)) {
+            cout << "Filter " << step.choice << " needs the whole image; use chain instead" << endl;
+            return false;
+        }
+    }
+
+    RowReader reader;
+    if (!open_row_reader(reader, input)) {
+        cout << input << ": could not read image" << endl;
+        return false;
+    }
+    if (reader.run_length_encoded) {
+        cout << input << ": run-length encoded images cannot be streamed; use chain instead" << endl;
+        return false;
+    }
+    RowWriter writer;
+    if (!open_row_writer(writer, output, reader.width, reader.height)) {
+        cout << output << ": could not write image" << endl;
+        return false;
+    }
+
+    // Rows arrive bottom row first, which is also the order they are written in
+    // Every filter works on the row in place, so no pixels are allocated per row
+    vector<Pixel> row;
+    int index;
+    while ((index = read_row(reader, row)) >= 0) {
+        for (const Step& step : steps) {
+            point_filter_row(step, row, index, 0, reader.width, reader.height);
+        }
+        write_row(writer, row);
+    }
+
+    if (!close_row_writer(writer)) {
+        cout << output << ": could not write image" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Tiles are squares of TILE_SIZE x TILE_SIZE pixels stored as 24-bit Blue, Green, Red
+const int TILE_SIZE = 256;
+const int TILE_BYTES = TILE_SIZE * TILE_SIZE * 3;
+
+// Fewest tiles cached per image, whatever the budget (enough for a rotated tile's sources)
+const int MIN_CACHED_TILES = 16;
+
+// Tile slot structure
+// One cached tile of a tiled image
+struct TileSlot
+{
+    // Index of the cached tile, or -1 if the slot is free
+    int tile;
+    // True if the pixels changed since the tile was loaded
+    bool dirty;
+    // Value of the image's use counter when the tile was last used
+    long long last_used;
+    // The pixels, row by row from the top
+    vector<unsigned char> data;
+};
+
+// Tiled image structure
+// A 24-bit image kept as tiles in a scratch file, with only a bounded number of
+// tiles cached in memory. Tiles that were never written come from the source BMP,
+// which is mapped into memory.
+struct TiledImage
+{
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    // Scratch file descriptor, and for each tile whether the file holds its pixels
+    int scratch = -1;
+    vector<bool> stored;
+    // For each tile, the slot that caches it (-1 if none)
+    vector<int> slot_of_tile;
+    vector<TileSlot> slots;
+    long long use_counter;
+    // The tile looked up last by tiled_pixel()
+    int last_tile;
+    unsigned char* last_data;
+    // True after a scratch file read or write failed
+    bool failed;
+    // Source BMP headers and the mapped file (nullptr if the image has no source)
+    RowReader source;
+    const unsigned char* mapped = nullptr;
+    size_t mapped_size;
+    // Bytes of the mapped file touched since its pages were last released
+    size_t mapped_touched;
+};
+
+/**
+ * Sets up a black tiled image with an empty scratch file and tile cache
+ * @param image  the tiled image to set up
+ * @param width  width of the image
+ * @param height height of the image
+ * @param budget memory for cached tiles in bytes (at least MIN_CACHED_TILES are cached)
+ * @return True if the scratch file could be created and false otherwise
+ */
+bool create_tiled_image(TiledImage& image, int width, int height, size_t budget)
+{
+    image.width = width;
+    image.height = height;
+    image.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    image.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles = image.tiles_x * image.tiles_y;
+    image.stored.assign(tiles, false);
+    image.slot_of_tile.assign(tiles, -1);
+
+    // Slot memory is only allocated when a slot is first used
+    size_t slots = max((size_t)MIN_CACHED_TILES, budget / TILE_BYTES);
+    image.slots.assign(min(slots, (size_t)tiles), {-1, false, 0, {}});
+    image.use_counter = 0;
+    image.last_tile = -1;
+    image.last_data = nullptr;
+    image.failed = false;
+    image.mapped = nullptr;
+    image.mapped_size = 0;
+    image.mapped_touched = 0;
+
+    // The scratch file is unlinked right away so it disappears with the process
+    const char* directory = getenv("TMPDIR");
+    string name = string(directory ? directory : "/tmp") + "/tiles-XXXXXX";
+    image.scratch = mkstemp(&name[0]);
+    if (image.scratch < 0)
+    {
+        return false;
+    }
+    unlink(name.c_str());
+    return true;
+}
+
+/**
+ * Opens a BMP file as a tiled image. The file is mapped into memory and tiles are
+ * decoded from it the first time they are used.
+ * Run-length encoded files cannot be opened this way.
+ * @param image    the tiled image to set up
+ * @param filename BMP image filename
+ * @param budget   memory for cached tiles in bytes
+ * @return True if the file is a valid image and false otherwise
+ */
+bool open_tiled_image(TiledImage& image, string filename, size_t budget)
+{
+    RowReader& source = image.source;
+    if (!open_row_reader(source, filename) || source.run_length_encoded)
+    {
+        return false;
+    }
+    source.stream.close();
+    if (!create_tiled_image(image, source.width, source.height, budget))
+    {
+        return false;
+    }
+
+    int descriptor = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (descriptor < 0 || fstat(descriptor, &info) != 0)
+    {
+        if (descriptor >= 0)
+        {
+            close(descriptor);
+        }
+        return false;
+    }
+    size_t size = info.st_size;
+    void* mapped = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+    image.mapped = (const unsigned char*)mapped;
+    image.mapped_size = size;
+
+    // The headers were checked against the size they claim, not the size of the file
+    return (size_t)source.start + (size_t)source.row_bytes * source.height <= size;
+}
+
+/**
+ * Releases the tile cache, the scratch file and the mapped source of a tiled image
+ * @param image the tiled image
+ * @return nothing
+ */
+void close_tiled_image(TiledImage& image)
+{
+    if (image.mapped != nullptr)
+    {
+        munmap((void*)image.mapped, image.mapped_size);
+        image.mapped = nullptr;
+    }
+    if (image.scratch >= 0)
+    {
+        close(image.scratch);
+        image.scratch = -1;
+    }
+    vector<TileSlot>().swap(image.slots);
+}
+
+/**
+ * Fills a tile with its pixels from the scratch file, the mapped source BMP or black.
+ * Helper function for get_tile()
+ * @param image the tiled image
+ * @param tile  index of the tile
+ * @param data  the tile's pixels to fill
+ * @return nothing
+ */
+void load_tile(TiledImage& image, int tile, unsigned char* data)
+{
+    if (image.stored[tile])
+    {
+        if (pread(image.scratch, data, TILE_BYTES, (off_t)tile * TILE_BYTES) != TILE_BYTES)
+        {
+            image.failed = true;
+        }
+        return;
+    }
+    if (image.mapped == nullptr)
+    {
+        memset(data, 0, TILE_BYTES);
+        return;
+    }
+
+    // Decode the part of each scan line that falls inside the tile
+    // (tile edges are whole bytes into the line because TILE_SIZE is a multiple of 8)
+    const RowReader& source = image.source;
+    int first_col = tile % image.tiles_x * TILE_SIZE;
+    int first_row = tile / image.tiles_x * TILE_SIZE;
+    int cols = min(TILE_SIZE, image.width - first_col);
+    int rows = min(TILE_SIZE, image.height - first_row);
+    vector<Pixel> pixels(cols);
+    for (int r = 0; r < rows; r++)
+    {
+        // Note: BMP files store pixels from bottom to top
+        size_t line = image.height - 1 - (first_row + r);
+        const unsigned char* bytes = image.mapped + source.start + line * source.row_bytes + (size_t)first_col * source.bits_per_pixel / 8;
+        decode_scan_line(source, bytes, pixels);
+        pixels_to_bgr24(pixels.data(), data + r * TILE_SIZE * 3, cols);
+    }
+
+    // Mapped pages count as memory in use until they are released, so release them
+    // whenever the pages touched (each scan line may cover up to two more) reach the budget
+    image.mapped_touched += rows * ((size_t)cols * source.bits_per_pixel / 8 + 2 * 4096);
+    if (image.mapped_touched >= image.slots.size() * TILE_BYTES)
+    {
+        madvise((void*)image.mapped, image.mapped_size, MADV_DONTNEED);
+        image.mapped_touched = 0;
+    }
+}
+
+/**
+ * Gets the pixels of a tile, loading it into the cache if needed. The least recently
+ * used tile makes room, and is written to the scratch file first if it changed.
+ * @param image   the tiled image
+ * @param tile    index of the tile (row of tiles times tiles_x plus column of tiles)
+ * @param writing true if the caller will change the pixels
+ * @return the tile's pixels, which stay cached while fewer than MIN_CACHED_TILES
+ *         other tiles of the image are used
+ */
+unsigned char* get_tile(TiledImage& image, int tile, bool writing)
+{
+    int slot_index = image.slot_of_tile[tile];
+    if (slot_index < 0)
+    {
+        // Free slots were never used, so they come before any cached tile
+        slot_index = 0;
+        for (size_t i = 1; i < image.slots.size(); i++)
+        {
+            if (image.slots[i].last_used < image.slots[slot_index].last_used)
+            {
+                slot_index = i;
+            }
+        }
+
+        TileSlot& slot = image.slots[slot_index];
+        if (slot.tile >= 0)
+        {
+            if (slot.dirty)
+            {
+                if (pwrite(image.scratch, slot.data.data(), TILE_BYTES, (off_t)slot.tile * TILE_BYTES) != TILE_BYTES)
+                {
+                    image.failed = true;
+                }
+                image.stored[slot.tile] = true;
+            }
+            image.slot_of_tile[slot.tile] = -1;
+            if (image.last_tile == slot.tile)
+            {
+                image.last_tile = -1;
+            }
+        }
+        slot.data.resize(TILE_BYTES);
+        load_tile(image, tile, slot.data.data());
+        slot.tile = tile;
+        slot.dirty = false;
+        image.slot_of_tile[tile] = slot_index;
+    }
+
+    TileSlot& slot = image.slots[slot_index];
+    slot.last_used = ++image.use_counter;
+    slot.dirty = slot.dirty || writing;
+    return slot.data.data();
+}
+
+/**
+ * Gets one pixel of a tiled image for reading. Lookups in the same tile as the
+ * previous one skip the cache.
+ * @param image the tiled image
+ * @param x     column of the pixel
+ * @param y     row of the pixel
+ * @return the pixel (Blue, Green, Red)
+ */
+const unsigned char* tiled_pixel(TiledImage& image, int x, int y)
+{
+    int tile = (y / TILE_SIZE) * image.tiles_x + x / TILE_SIZE;
+    if (tile != image.last_tile)
+    {
+        image.last_data = get_tile(image, tile, false);
+        image.last_tile = tile;
+    }
+    return image.last_data + ((y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * 3;
+}
+
+/**
+ * Writes a tiled image as a 24-bit BMP file, tile by tile, straight to each
+ * tile row's place in the file
+ * @param image    the tiled image
+ * @param filename The BMP file name to save the image to
+ * @return True if successful and false otherwise
+ */
+bool write_tiled_image(TiledImage& image, string filename)
+{
+    fstream stream(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    write_headers(stream, image.width, image.height, 24, {});
+    stream.close();
+    if (stream.fail())
+    {
+        return false;
+    }
+
+    // The pixel array follows the 54 bytes of headers, padding included
+    const long long start = 54;
+    long long row_bytes = ((long long)image.width * 3 + 3) / 4 * 4;
+    int descriptor = open(filename.c_str(), O_WRONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    bool written = ftruncate(descriptor, start + row_bytes * image.height) == 0;
+    for (int tile = 0; written && tile < image.tiles_x * image.tiles_y; tile++)
+    {
+        int first_col = tile % image.tiles_x * TILE_SIZE;
+        int first_row = tile / image.tiles_x * TILE_SIZE;
+        int cols = min(TILE_SIZE, image.width - first_col);
+        int rows = min(TILE_SIZE, image.height - first_row);
+        const unsigned char* data = get_tile(image, tile, false);
+        for (int r = 0; r < rows && written; r++)
+        {
+            // Note: BMP files store pixels from bottom to top
+            long long offset = start + (image.height - 1 - (first_row + r)) * row_bytes + first_col * 3LL;
+            written = write_at(descriptor, data + r * TILE_SIZE * 3, cols * 3, offset);
+        }
+    }
+    close(descriptor);
+    return written && !image.failed;
+}
+
+/**
+ * Applies a filter that only depends on each pixel and its position, one tile at a time
+ * @param image  the input tiled image
+ * @param result the output tiled image (same size as the input)
+ * @param step   the filter and its parameters
+ * @return nothing
+ */
+void tiled_point_filter(TiledImage& image, TiledImage& result, const Step& step)
+{
+    vector<vector<Pixel> > pixels;
+    for (int tile = 0; tile < image.tiles_x * image.tiles_y; tile++) {
+        int first_col = tile % image.tiles_x * TILE_SIZE;
+        int first_row = tile / image.tiles_x * TILE_SIZE;
+        int cols = min(TILE_SIZE, image.width - first_col);
+        int rows = min(TILE_SIZE, image.height - first_row);
+        const unsigned char* in = get_tile(image, tile, false);
+        unsigned char* out = get_tile(result, tile, true);
+
+        pixels.assign(rows, vector<Pixel> (cols));
+        for (int r = 0; r < rows; r++) { // height (a.k.a. number of rows)
+            bgr24_to_pixels(in + r * TILE_SIZE * 3, pixels[r].data(), cols);
+        }
+
+        // The vignette depends on where the tile sits in the whole image
+        for (int r = 0; r < rows; r++) {
+            point_filter_row(step, pixels[r], first_row + r, first_col, image.width, image.height);
+        }
+
+        // Color values are stored as bytes, exactly as the 24-bit writer would
+        for (int r = 0; r < rows; r++) {
+            pixels_to_bgr24(pixels[r].data(), out + r * TILE_SIZE * 3, cols);
+        }
+    }
+}
+
+/**
+ * Applies a transform to a tiled image, filling each output tile from the source
+ * pixels it maps to
+ * @param image     the input tiled image
+ * @param result    the output tiled image (the size of the transformed image)
+ * @param transform the transform to apply
+ * @return nothing
+ */
+void tiled_transform(TiledImage& image, TiledImage& result, const Transform& transform)
+{
+    // The same source positions as apply_transform()
+    bool swapped = (transform.matrix[0][0] == 0);
+    bool reverse_rows = swapped ? (transform.matrix[1][0] < 0) : (transform.matrix[0][0] < 0);
+    bool reverse_cols = swapped ? (transform.matrix[0][1] < 0) : (transform.matrix[1][1] < 0);
+
+    for (int tile = 0; tile < result.tiles_x * result.tiles_y; tile++) {
+        int first_col = tile % result.tiles_x * TILE_SIZE;
+        int first_row = tile / result.tiles_x * TILE_SIZE;
+        int cols = min(TILE_SIZE, result.width - first_col);
+        int rows = min(TILE_SIZE, result.height - first_row);
+        unsigned char* out = get_tile(result, tile, true);
+
+        for (int r = 0; r < rows; r++) { // height (a.k.a. number of rows)
+            int base_row = (first_row + r) / transform.y_scale;
+            for (int c = 0; c < cols; c++) { // width (a.k.a. number of columns)
+                int base_col = (first_col + c) / transform.x_scale;
+                int source_row = swapped ? base_col : base_row;
+                int source_col = swapped ? base_row : base_col;
+                if (reverse_rows) {
+                    source_row = image.height - 1 - source_row;
+                }
+                if (reverse_cols) {
+                    source_col = image.width - 1 - source_col;
+                }
+                memcpy(out + (r * TILE_SIZE + c) * 3, tiled_pixel(image, source_col, source_row), 3);
+            }
+        }
+    }
+}
+
+/**
+ * Rotates a tiled image by an arbitrary angle the way process_11() does, one output
+ * tile at a time
+ * @param image  the input tiled image
+ * @param result the output tiled image (the size given by rotated_size())
+ * @param angle  the angle in degrees clockwise
+ * @return nothing
+ */
+void tiled_rotate(TiledImage& image, TiledImage& result, double angle)
+{
+    double radians = angle * M_PI / 180.0;
+    double cos_angle = cos(radians);
+    double sin_angle = sin(radians);
+    double center_x = (image.width - 1) / 2.0;
+    double center_y = (image.height - 1) / 2.0;
+    double new_center_x = (result.width - 1) / 2.0;
+    double new_center_y = (result.height - 1) / 2.0;
+
+    // Source coordinates advance by a constant step along each output row (16.16 fixed point)
+    const double ONE = 65536.0;
+    long long step_x = llround(cos_angle * ONE);
+    long long step_y = llround(-sin_angle * ONE);
+    long long limit_x = (long long)(image.width - 1) << 16;
+    long long limit_y = (long long)(image.height - 1) << 16;
+
+    for (int tile = 0; tile < result.tiles_x * result.tiles_y; tile++) {
+        int first_col = tile % result.tiles_x * TILE_SIZE;
+        int first_row = tile / result.tiles_x * TILE_SIZE;
+        int cols = min(TILE_SIZE, result.width - first_col);
+        int rows = min(TILE_SIZE, result.height - first_row);
+        unsigned char* out = get_tile(result, tile, true);
+
+        for (int r = 0; r < rows; r++) { // height (a.k.a. number of rows)
+            int row = first_row + r;
+            long long start_x = llround((center_x - new_center_x * cos_angle + (row - new_center_y) * sin_angle) * ONE);
+            long long start_y = llround((center_y + new_center_x * sin_angle + (row - new_center_y) * cos_angle) * ONE);
+
+            // Pixels outside the source stay black
+            int first = first_col;
+            int last = first_col + cols - 1;
+            memset(out + r * TILE_SIZE * 3, 0, cols * 3);
+            clip_span(start_x, step_x, limit_x, first, last);
+            clip_span(start_y, step_y, limit_y, first, last);
+
+            for (int col = first; col <= last; col++) { // width (a.k.a. number of columns)
+                long long source_x = start_x + step_x * col;
+                long long source_y = start_y + step_y * col;
+                int x0 = source_x >> 16;
+                int y0 = source_y >> 16;
+                int fx = (source_x >> 8) & 0xFF;
+                int fy = (source_y >> 8) & 0xFF;
+                int x1 = x0 + (x0 < image.width - 1);
+                int y1 = y0 + (y0 < image.height - 1);
+
+                // The four neighbours may sit in different tiles
+                const unsigned char* corners[4] = {tiled_pixel(image, x0, y0), tiled_pixel(image, x1, y0),
+                                                   tiled_pixel(image, x0, y1), tiled_pixel(image, x1, y1)};
+                unsigned char* pixel = out + (r * TILE_SIZE + col - first_col) * 3;
+                for (int channel = 0; channel < 3; channel++) {
+                    int top = corners[0][channel] * (256 - fx) + corners[1][channel] * fx;
+                    int bottom = corners[2][channel] * (256 - fx) + corners[3][channel] * fx;
+                    pixel[channel] = (top * (256 - fy) + bottom * fy + 32768) >> 16;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Applies a sequence of filters to a BMP file out of core: the image is processed
+ * in tiles that are paged between a bounded cache and scratch files, so memory use
+ * stays within the budget whatever the size of the image. Consecutive geometric
+ * filters are composed and applied in one pass. The result is written as a 24-bit BMP,
+ * and values between filters are kept as bytes, as if each result had been saved.
+ * @param input  the input BMP filename
+ * @param output the output BMP filename
+ * @param steps  the filters in the order they are applied
+ * @param budget memory for cached tiles in bytes, shared by the input and output of each filter
+ * @return True if successful and false otherwise
+ */
+bool run_tiled(string input, string output, const vector<Step>& steps, size_t budget)
+{
+    if (copy_identity(input, output, steps)) {
+        return true;
+    }
+    for (const Step& step : steps) {
+        bool valid_scale = (step.choice != 6 || (step.value1 >= 1 && step.value2 >= 1)) &&
+                           (step.choice != 12 || (step.value2 >= 1 && step.value3 >= 1));
+        if (step.choice < 1 || step.choice > 14 || !valid_scale) {
+            cout << "Unknown filter or invalid parameters: " << step.choice << endl;
+            return false;
+        }
+    }
+
+    // The current image and the result of the filter being applied
+    TiledImage images[2];
+    int current = 0;
+    if (!open_tiled_image(images[0], input, budget / 2)) {
+        cout << input << ": could not read image (run-length encoded images cannot be tiled)" << endl;
+        close_tiled_image(images[0]);
+        return false;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < steps.size() && success; i++) {
+        TiledImage& image = images[current];
+        TiledImage& result = images[1 - current];
+        const Step& step = steps[i];
+
+        // Compose this filter and any geometric filters right after it
+        Transform combined = identity_transform();
+        Transform transform;
+        int width = image.width;
+        int height = image.height;
+        size_t first_step = i;
+        while (i < steps.size() && step_transform(steps[i], width, height, transform)) {
+            combined = compose_transforms(combined, transform);
+            if (transform.matrix[0][0] == 0) {
+                swap(width, height);
+            }
+            width *= transform.x_scale;
+            height *= transform.y_scale;
+            i++;
+        }
+
+        if (i > first_step) {
+            // The loop above moved past the composed filters
+            i--;
+            success = create_tiled_image(result, width, height, budget / 2);
+            if (success) {
+                tiled_transform(image, result, combined);
+            }
+        } else if (step.choice == 11) {
+            rotated_size(image.width, image.height, step.value1, step.value2 != 0, width, height);
+            success = create_tiled_image(result, width, height, budget / 2);
+            if (success) {
+                tiled_rotate(image, result, step.value1);
+            }
+        } else {
+            success = create_tiled_image(result, width, height, budget / 2);
+            if (success) {
+                tiled_point_filter(image, result, step);
+            }
+        }
+        success = success && !image.failed;
+        close_tiled_image(image);
+        current = 1 - current;
+    }
+
+    success = success && write_tiled_image(images[current], output);
+    close_tiled_image(images[0]);
+    close_tiled_image(images[1]);
+    if (!success) {
+        cout << output << ": could not write image" << endl;
+    }
+    return success;
+}
+
+/**
+ * Computes a perceptual difference hash (dHash) of an image.
+ * The luma is averaged down to 9x8 cells and each bit records whether a cell is
+ * darker than its right neighbour, so resaving, small edits and rescaling keep
+ * the hash (almost) unchanged.
+ * @param image the image
+ * @return the 64-bit hash
+ */
+unsigned long long perceptual_hash(const vector<vector<Pixel> >& image)
+{
+    const int CELLS_X = 9;
+    const int CELLS_Y = 8;
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Cell of each column and the number of pixels along each side of the cells
+    // (cells may be empty for tiny images)
+    vector<int> cell_of_col(width_pixels);
+    int cols_in_cell[CELLS_X] = {0};
+    int rows_in_cell[CELLS_Y] = {0};
+    for (int col = 0; col < width_pixels; col++) {
+        cell_of_col[col] = (long long)col * CELLS_X / width_pixels;
+        cols_in_cell[cell_of_col[col]]++;
+    }
+
+    // Sum the luma of each cell
+    double sums[CELLS_Y][CELLS_X] = {{0}};
+    vector<long long> row_sums(CELLS_X);
+    for (int row = 0; row < height_pixels; row++) {
+        int cell_y = (long long)row * CELLS_Y / height_pixels;
+        rows_in_cell[cell_y]++;
+        fill(row_sums.begin(), row_sums.end(), 0);
+        for (int col = 0; col < width_pixels; col++) {
+            const Pixel& pixel = image[row][col];
+            row_sums[cell_of_col[col]] += pixel.red * 77 + pixel.green * 150 + pixel.blue * 29;
+        }
+        for (int cell_x = 0; cell_x < CELLS_X; cell_x++) {
+            sums[cell_y][cell_x] += row_sums[cell_x];
+        }
+    }
+
+    unsigned long long hash = 0;
+    for (int cell_y = 0; cell_y < CELLS_Y; cell_y++) {
+        for (int cell_x = 0; cell_x < CELLS_X - 1; cell_x++) {
+            double left = sums[cell_y][cell_x] / max(1, cols_in_cell[cell_x] * rows_in_cell[cell_y]);
+            double right = sums[cell_y][cell_x + 1] / max(1, cols_in_cell[cell_x + 1] * rows_in_cell[cell_y]);
+            hash = (hash << 1) | (left < right ? 1 : 0);
+        }
+    }
+    return hash;
+}
+
+/**
+ * Counts the bits that differ between two hashes
+ * @param first  the first hash
+ * @param second the second hash
+ * @return the Hamming distance
+ */
+int hamming_distance(unsigned long long first, unsigned long long second)
+{
+    return bitset<64>(first ^ second).count();
+}
+
+/**
+ * Applies one filter to every image listed in a text file.
+ * Each line of the list holds an input and an output filename. Inputs whose
+ * perceptual hash is within the threshold of an earlier input of the same size are treated as
+ * duplicates: their output is copied from the earlier result, or skipped.
+ * If the filter changes nothing, each input is copied to its output without decoding it.
+ * @param list_filename the list of input and output filenames
+ * @param choice        the menu number of the filter
+ * @param value1        first filter parameter
+ * @param value2        second filter parameter
+ * @param value3        third filter parameter
+ * @param threshold     largest Hamming distance treated as a duplicate (-1 disables)
+ * @param skip          true to skip duplicates instead of copying the earlier output
+ * @param allow_link    true to hard link copies to the file they copy where possible
+ * @param report_memory true to print the allocations of each image's decode, filter and encode
+ * @return the number of images that failed
+ */
+int run_batch(string list_filename, int choice, double value1, double value2, double value3, int threshold, bool skip, bool allow_link, bool report_memory)
+{
+    ifstream list(list_filename);
+    if (!list.is_open()) {
+        cout << "Could not open " << list_filename << endl;
+        return 1;
+    }
+
+    // Hashes and sizes of the inputs processed so far, and the outputs they produced
+    vector<unsigned long long> hashes;
+    vector<int> widths, heights;
+    vector<string> outputs;
+
+    int processed = 0, duplicates = 0, failures = 0;
+    bool identity = is_identity_chain({{choice, value1, value2, value3}});
+    string input, output;
+    while (list >> input >> output) {
+        if (identity) {
+            RowReader reader;
+            if (!open_row_reader(reader, input)) {
+                cout << input << ": could not read image" << endl;
+                failures++;
+                continue;
+            }
+            if (!copy_file(input, output, allow_link)) {
+                cout << input << ": could not copy to " << output << endl;
+                failures++;
+                continue;
+            }
+            processed++;
+            cout << input << " -> " << output << " (copied, the filter changes nothing)" << endl;
+            continue;
+        }
+
+        AllocationStats decode_stats;
+        begin_allocations(decode_stats);
+        vector<vector<Pixel> > image = read_image(input);
+        if (image.empty()) {
+            cout << input << ": could not read image" << endl;
+            failures++;
+            continue;
+        }
+        end_allocations(decode_stats);
+
+        // Look for an earlier near-duplicate of the same size
+        unsigned long long hash = perceptual_hash(image);
+        int width = image[0].size();
+        int height = image.size();
+        int match = -1;
+        for (int i = 0; i < (int)hashes.size() && threshold >= 0; i++) {
+            if (widths[i] == width && heights[i] == height && hamming_distance(hash, hashes[i]) <= threshold) {
+                match = i;
+                break;
+            }
+        }
+
+        if (match >= 0) {
+            duplicates++;
+            if (skip) {
+                cout << input << ": skipped (duplicate of the input for " << outputs[match] << ")" << endl;
+            } else if (copy_file(outputs[match], output, allow_link)) {
+                cout << input << " -> " << output << " (reused " << outputs[match] << ")" << endl;
+            } else {
+                cout << input << ": could not copy " << outputs[match] << endl;
+                failures++;
+            }
+            continue;
+        }
+
+        AllocationStats filter_stats;
+        begin_allocations(filter_stats);
+        vector<vector<Pixel> > new_image = apply_filter(choice, image, value1, value2, value3);
+        end_allocations(filter_stats);
+
+        AllocationStats encode_stats;
+        begin_allocations(encode_stats);
+        if (new_image.empty() || !write_image(output, new_image)) {
+            cout << input << ": could not write " << output << endl;
+            failures++;
+            continue;
+        }
+        end_allocations(encode_stats);
+        hashes.push_back(hash);
+        widths.push_back(width);
+        heights.push_back(height);
+        outputs.push_back(output);
+        processed++;
+        cout << input << " -> " << output << endl;
+        if (report_memory) {
+            print_allocations("decode", decode_stats);
+            print_allocations("filter", filter_stats);
+            print_allocations("encode", encode_stats);
+        }
+    }
+
+    cout << processed << " processed, " << duplicates << " duplicates, " << failures << " failed" << endl;
+    return failures;
+}
+
+/**
+ * Computes the 64-bit FNV-1a hash of the contents of a file
+ * @param filename the file
+ * @param hash     set to the hash
+ * @return True if the whole file could be read and false otherwise
+ */
+bool hash_file(string filename, unsigned long long& hash)
+{
+    int descriptor = open(filename.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    hash = 14695981039346656037ull;
+    vector<unsigned char> buffer(1 << 20);
+    ssize_t count;
+    while ((count = read(descriptor, buffer.data(), buffer.size())) != 0)
+    {
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(descriptor);
+            return false;
+        }
+        for (ssize_t i = 0; i < count; i++)
+        {
+            hash = (hash ^ buffer[i]) * 1099511628211ull;
+        }
+    }
+    close(descriptor);
+    return true;
+}
+
+/**
+ * Writes an index of the BMP files in a directory: the dimensions, bits per pixel,
+ * file size and content hash of each, one line per file. Only the headers are parsed,
+ * and the files are probed and hashed in parallel.
+ * @param directory the directory to scan
+ * @param output    the index file to write
+ * @return the number of files that could not be indexed
+ */
+int run_index(string directory, string output)
+{
+    DIR* listing = opendir(directory.c_str());
+    if (listing == nullptr) {
+        cout << "Could not open " << directory << endl;
+        return 1;
+    }
+    vector<string> names;
+    while (dirent* entry = readdir(listing)) {
+        string name = entry->d_name;
+        if (name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".bmp") == 0) {
+            names.push_back(name);
+        }
+    }
+    closedir(listing);
+    sort(names.begin(), names.end());
+
+    // Each thread fills in the lines of its own band of files
+    vector<string> lines(names.size());
+    parallel_for_rows(names.size(), [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            string path = directory + "/" + names[i];
+            BmpInfo info;
+            unsigned long long hash;
+            if (!probe_image(path, info) || !hash_file(path, hash)) {
+                continue;
+            }
+            char line[512];
+            snprintf(line, sizeof(line), "%s\t%d\t%d\t%d\t%lld\t%016llx", names[i].c_str(), info.width, info.height,
+                     info.bits_per_pixel, info.file_size, hash);
+            lines[i] = line;
+        }
+    });
+
+    ofstream index(output);
+    index << "# file\twidth\theight\tbits_per_pixel\tbytes\tfnv1a64" << endl;
+    int failures = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (lines[i].empty()) {
+            cout << names[i] << ": not a valid image" << endl;
+            failures++;
+        } else {
+            index << lines[i] << endl;
+        }
+    }
+    if (!index) {
+        cout << output << ": could not write index" << endl;
+        return failures + 1;
+    }
+    cout << names.size() - failures << " images indexed, " << failures << " skipped" << endl;
+    return failures;
+}
+
+// Comparison structure
+struct Comparison
+{
+    // Largest difference of any color value
+    int max_diff;
+    // Peak signal-to-noise ratio in dB (infinite for identical images)
+    double psnr;
+    // Mean structural similarity of the luma, 1 for identical images
+    double ssim;
+};
+
+/**
+ * Computes the structural similarity of the luma of two images of the same size.
+ * Window sums come from running column sums, so each window costs O(1) and only
+ * a few rows of sums are kept per thread.
+ * Helper function for compare_images()
+ * @param first  the first image
+ * @param second the second image
+ * @return the mean SSIM over all 8x8 windows
+ */
+double structural_similarity(const vector<vector<Pixel> >& first, const vector<vector<Pixel> >& second)
+{
+    int width_pixels = first[0].size();
+    int height_pixels = first.size();
+    int window_width = min(8, width_pixels);
+    int window_height = min(8, height_pixels);
+    int windows_x = width_pixels - window_width + 1;
+    int windows_y = height_pixels - window_height + 1;
+    double inverse_count = 1.0 / (window_width * window_height);
+
+    // Stabilizing constants from the SSIM definition for 8-bit values
+    const double C1 = (0.01 * 255) * (0.01 * 255);
+    const double C2 = (0.03 * 255) * (0.03 * 255);
+
+    vector<double> band_totals(windows_y, 0.0);
+    parallel_for_rows(windows_y, [&](int begin, int end) {
+        // Luma of one row of each image
+        vector<int> luma_first(width_pixels), luma_second(width_pixels);
+        // Column sums over the current window rows of x, y, x*x, y*y and x*y
+        vector<int> sum_x(width_pixels, 0), sum_y(width_pixels, 0);
+        vector<int> sum_xx(width_pixels, 0), sum_yy(width_pixels, 0), sum_xy(width_pixels, 0);
+
+        // Adds (sign 1) or removes (sign -1) one image row from the column sums
+        auto accumulate = [&](int row, int sign) {
+            for (int col = 0; col < width_pixels; col++) {
+                const Pixel& a = first[row][col];
+                const Pixel& b = second[row][col];
+                luma_first[col] = (a.red * 77 + a.green * 150 + a.blue * 29) >> 8;
+                luma_second[col] = (b.red * 77 + b.green * 150 + b.blue * 29) >> 8;
+            }
+            for (int col = 0; col < width_pixels; col++) {
+                int x = luma_first[col];
+                int y = luma_second[col];
+                sum_x[col] += sign * x;
+                sum_y[col] += sign * y;
+                sum_xx[col] += sign * x * x;
+                sum_yy[col] += sign * y * y;
+                sum_xy[col] += sign * x * y;
+            }
+        };
+
+        for (int row = begin; row < begin + window_height - 1; row++) {
+            accumulate(row, 1);
+        }
+        for (int row = begin; row < end; row++) {
+            accumulate(row + window_height - 1, 1);
+
+            // Slide the window along the row using the column sums
+            long long x = 0, y = 0, xx = 0, yy = 0, xy = 0;
+            for (int col = 0; col < window_width - 1; col++) {
+                x += sum_x[col]; y += sum_y[col]; xx += sum_xx[col]; yy += sum_yy[col]; xy += sum_xy[col];
+            }
+            double total = 0;
+            for (int col = 0; col < windows_x; col++) {
+                int right = col + window_width - 1;
+                x += sum_x[right]; y += sum_y[right]; xx += sum_xx[right]; yy += sum_yy[right]; xy += sum_xy[right];
+
+                double mean_x = x * inverse_count;
+                double mean_y = y * inverse_count;
+                double variance_x = xx * inverse_count - mean_x * mean_x;
+                double variance_y = yy * inverse_count - mean_y * mean_y;
+                double covariance = xy * inverse_count - mean_x * mean_y;
+                total += ((2 * mean_x * mean_y + C1) * (2 * covariance + C2)) /
+                         ((mean_x * mean_x + mean_y * mean_y + C1) * (variance_x + variance_y + C2));
+
+                x -= sum_x[col]; y -= sum_y[col]; xx -= sum_xx[col]; yy -= sum_yy[col]; xy -= sum_xy[col];
+            }
+            band_totals[row] = total;
+
+            accumulate(row, -1);
+        }
+    });
+
+    double total = 0;
+    for (double band_total : band_totals) {
+        total += band_total;
+    }
+    return total / ((double)windows_x * windows_y);
+}
+
+/**
+ * Compares two images of the same size
+ * @param first  the first image
+ * @param second the second image
+ * @return the largest difference, PSNR and SSIM of the two images
+ */
+Comparison compare_images(const vector<vector<Pixel> >& first, const vector<vector<Pixel> >& second)
+{
+    int width_pixels = first[0].size();
+    int height_pixels = first.size();
+
+    // Per-row results so each thread writes to its own slots
+    vector<int> row_max(height_pixels, 0);
+    vector<long long> row_squared(height_pixels, 0);
+    parallel_for_rows(height_pixels, [&](int begin, int end) {
+        for (int row = begin; row < end; row++) {
+            const Pixel* a = first[row].data();
+            const Pixel* b = second[row].data();
+            int largest = 0;
+            long long squared = 0;
+            for (int col = 0; col < width_pixels; col++) {
+                int red = abs(a[col].red - b[col].red);
+                int green = abs(a[col].green - b[col].green);
+                int blue = abs(a[col].blue - b[col].blue);
+                largest = max(largest, max(max(red, green), blue));
+                squared += red * red + green * green + blue * blue;
+            }
+            row_max[row] = largest;
+            row_squared[row] = squared;
+        }
+    });
+
+    Comparison result;
+    result.max_diff = 0;
+    long long squared = 0;
+    for (int row = 0; row < height_pixels; row++) {
+        result.max_diff = max(result.max_diff, row_max[row]);
+        squared += row_squared[row];
+    }
+    double mean_squared = (double)squared / (3.0 * width_pixels * height_pixels);
+    result.psnr = (mean_squared == 0) ? INFINITY : 10 * log10(255.0 * 255.0 / mean_squared);
+    result.ssim = structural_similarity(first, second);
+    return result;
+}
+
+/**
+ * Creates a heat map of the differences between two images of the same size:
+ * black where they match, through red and yellow to white for the largest differences
+ * @param first  the first image
+ * @param second the second image
+ * @return the heat map image
+ */
+vector<vector<Pixel> > difference_map(const vector<vector<Pixel> >& first, const vector<vector<Pixel> >& second)
+{
+    int width_pixels = first[0].size();
+    int height_pixels = first.size();
+
+    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+    parallel_for_rows(height_pixels, [&](int begin, int end) {
+        for (int row = begin; row < end; row++) {
+            for (int col = 0; col < width_pixels; col++) {
+                const Pixel& a = first[row][col];
+                const Pixel& b = second[row][col];
+                int diff = max(max(abs(a.red - b.red), abs(a.green - b.green)), abs(a.blue - b.blue));
+
+                // Small differences are amplified so they stay visible
+                int heat = min(765, diff * 12);
+                new_image[row][col].red = min(255, heat);
+                new_image[row][col].green = min(255, max(0, heat - 255));
+                new_image[row][col].blue = max(0, heat - 510);
+            }
+        }
+    });
+    return new_image;
+}
+
+// Hardware counters read around each benchmark run, with -1 for any counter the
+// processor or kernel does not offer
+const int PERF_COUNTERS = 5;
+const char* const PERF_COUNTER_NAMES[PERF_COUNTERS] = {"cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"};
+
+// Performance counter structure
+struct PerfCounters
+{
+    // perf_event file descriptors, -1 where a counter could not be opened
+    int fds[PERF_COUNTERS];
+    // Counts of the last measured run
+    long long values[PERF_COUNTERS];
+};
+
+/**
+ * Opens the Linux perf_event counters of this process and the threads it starts.
+ * Counters that are not available are left closed.
+ * @param counters the counters to open
+ * @return True if at least one counter could be opened and false otherwise
+ */
+bool open_perf_counters(PerfCounters& counters)
+{
+    const unsigned int types[PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                               PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    const unsigned long long configs[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES};
+
+    bool opened = false;
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        // Worker threads started while the counter runs are counted too
+        attr.inherit = 1;
+        // User space only, which is all an unprivileged process may count
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // With more counters than the processor has they take turns, and are scaled up
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        counters.values[i] = -1;
+        opened = opened || counters.fds[i] >= 0;
+    }
+    return opened;
+}
+
+/**
+ * Runs a function with the perf_event counters counting
+ * @param counters the open counters, whose values are set to the counts of the run
+ * @param run      the function
+ * @return nothing
+ */
+void count_perf_events(PerfCounters& counters, const function<void()>& run)
+{
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        if (counters.fds[i] >= 0)
+        {
+            ioctl(counters.fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    run();
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        counters.values[i] = -1;
+        if (counters.fds[i] < 0)
+        {
+            continue;
+        }
+        ioctl(counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        // The count, the time the counter was enabled and the time it really counted
+        unsigned long long data[3];
+        if (read(counters.fds[i], data, sizeof(data)) == (ssize_t)sizeof(data) && data[2] > 0)
+        {
+            counters.values[i] = (long long)((double)data[0] * data[1] / data[2]);
+        }
+    }
+}
+
+/**
+ * Closes the perf_event counters
+ * @param counters the counters
+ * @return nothing
+ */
+void close_perf_counters(PerfCounters& counters)
+{
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        if (counters.fds[i] >= 0)
+        {
+            close(counters.fds[i]);
+            counters.fds[i] = -1;
+        }
+    }
+}
+
+// Benchmark structure
+// A kernel of the benchmark and the data one run of it moves
+struct Benchmark
+{
+    string name;
+    // Bytes read plus bytes written by one run
+    double bytes;
+    function<void()> run;
+    // Checks the result of the last run against the reference kernel (none if empty)
+    function<bool()> check;
+    // True if the kernel splits its rows among worker_threads threads
+    bool parallel = false;
+};
+
+/**
+ * Times a function, keeping the fastest of several runs so that page faults and
+ * other one-off costs of the first run do not count
+ * @param run     the function
+ * @param repeats number of runs
+ * @return the time of the fastest run in seconds
+ */
+double time_best(const function<void()>& run, int repeats)
+{
+    double best = INFINITY;
+    for (int i = 0; i < repeats; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        run();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count());
+    }
+    return best;
+}
+
+// Levels of the memory hierarchy a working set can fit in
+const int MEMORY_LEVELS = 3;
+const char* const MEMORY_LEVEL_NAMES[MEMORY_LEVELS] = {"L2", "LLC", "DRAM"};
+// Kernels slower than this fraction of the copy bandwidth are flagged as optimization targets
+const double FAR_FROM_ROOF = 0.25;
+
+// Roofline structure
+// The copy bandwidth of each memory level, which bounds kernels that only move pixels
+struct Roofline
+{
+    // Largest working set that fits in each level in bytes
+    double sizes[MEMORY_LEVELS];
+    // Copy bandwidth of each level in GB/s
+    double rates[MEMORY_LEVELS];
+};
+
+/**
+ * Measures the bandwidth of copying an array to another, as the STREAM copy kernel
+ * does, on all threads
+ * @param bytes size of both arrays together
+ * @return the bandwidth in GB/s, counting the bytes read and written
+ */
+double copy_bandwidth(double bytes)
+{
+    const int BLOCK = 512;
+    int blocks = max(1, (int)(bytes / 2 / sizeof(double) / BLOCK));
+    size_t count = (size_t)blocks * BLOCK;
+    vector<double> source(count, 1.0), destination(count, 0.0);
+
+    // Small arrays are copied several times per run so that a run can be timed
+    int passes = max(1, (int)((64 << 20) / (count * 2 * sizeof(double))));
+    double seconds = time_best([&]() {
+        parallel_for_rows(blocks, [&](int first, int last) {
+            // One block at a time, since memcpy() switches to stores that bypass the
+            // cache for large copies and no kernel here does that
+            for (int pass = 0; pass < passes; pass++)
+            {
+                for (size_t i = (size_t)first * BLOCK; i < (size_t)last * BLOCK; i += BLOCK)
+                {
+                    memcpy(&destination[i], &source[i], BLOCK * sizeof(double));
+                }
+            }
+        });
+    }, 5);
+    return count * 2.0 * sizeof(double) * passes / seconds / 1e9;
+}
+
+/**
+ * Measures the copy bandwidth of working sets that fit in L2, in the last level
+ * cache and only in DRAM, using the cache sizes the C library reports
+ * @return the roofline
+ */
+Roofline measure_roofline()
+{
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    Roofline roofline;
+    roofline.sizes[0] = (l2 > 0) ? l2 : 1 << 20;
+    roofline.sizes[1] = (llc > 0) ? llc : 32 << 20;
+    roofline.sizes[2] = INFINITY;
+
+    // Half of a cache leaves room for everything else, and DRAM is measured well past the last level cache
+    double measured[MEMORY_LEVELS] = {roofline.sizes[0] / 2, roofline.sizes[1] / 2, max(roofline.sizes[1] * 4, 256.0 * (1 << 20))};
+    for (int level = 0; level < MEMORY_LEVELS; level++)
+    {
+        roofline.rates[level] = copy_bandwidth(measured[level]);
+    }
+    return roofline;
+}
+
+/**
+ * Finds the memory level a working set fits in
+ * @param roofline the roofline
+ * @param bytes    size of the working set
+ * @return the index of the level
+ */
+int memory_level(const Roofline& roofline, double bytes)
+{
+    int level = 0;
+    while (level < MEMORY_LEVELS - 1 && bytes > roofline.sizes[level])
+    {
+        level++;
+    }
+    return level;
+}
+
+/**
+ * Times each kernel and prints a row of the results, with the throughput compared
+ * to the copy bandwidth of the memory level its data fits in and, when counters are
+ * given, the hardware counts of one more run per pixel
+ * @param benchmarks the kernels
+ * @param repeats    number of runs of each kernel, of which the fastest counts
+ * @param pixels     number of pixels each kernel processes
+ * @param roofline   the copy bandwidth of each memory level
+ * @param counters   open perf_event counters, or nullptr to only time the kernels
+ * @return the number of kernels whose check failed
+ */
+int run_benchmarks(const vector<Benchmark>& benchmarks, int repeats, double pixels, const Roofline& roofline, PerfCounters* counters)
+{
+    cout << left << setw(28) << "kernel" << right << setw(10) << "ms" << setw(10) << "GB/s" << setw(6) << "roof" << setw(9) << "% roof";
+    if (counters)
+    {
+        cout << setw(10) << "cyc/px" << setw(8) << "IPC" << setw(10) << "LLC/kpx" << setw(10) << "dTLB/kpx" << setw(10) << "br/kpx";
+    }
+    cout << endl;
+
+    int mismatches = 0;
+    for (const Benchmark& benchmark : benchmarks)
+    {
+        double seconds = time_best(benchmark.run, repeats);
+        double rate = benchmark.bytes / seconds / 1e9;
+        int level = memory_level(roofline, benchmark.bytes);
+        double roof = rate / roofline.rates[level];
+        cout << left << setw(28) << benchmark.name << right << fixed << setprecision(2)
+             << setw(10) << seconds * 1000 << setw(10) << rate << setw(6) << MEMORY_LEVEL_NAMES[level]
+             << setw(8) << roof * 100 << "%";
+
+        if (counters)
+        {
+            count_perf_events(*counters, benchmark.run);
+            const long long* values = counters->values;
+            // Cycles per pixel, instructions per cycle, then misses per thousand pixels
+            double columns[5] = {values[0] / pixels, (double)values[1] / values[0], values[2] / pixels * 1000,
+                                 values[3] / pixels * 1000, values[4] / pixels * 1000};
+            bool available[5] = {values[0] >= 0, values[0] > 0 && values[1] >= 0, values[2] >= 0, values[3] >= 0, values[4] >= 0};
+            int widths[5] = {10, 8, 10, 10, 10};
+            for (int i = 0; i < 5; i++)
+            {
+                if (available[i])
+                {
+                    cout << setw(widths[i]) << columns[i];
+                }
+                else
+                {
+                    cout << setw(widths[i]) << "-";
+                }
+            }
+        }
+
+        if (roof < FAR_FROM_ROOF)
+        {
+            cout << "  far from roof";
+        }
+        if (benchmark.check && !benchmark.check())
+        {
+            cout << "  MISMATCH";
+            mismatches++;
+        }
+        cout << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    return mismatches;
+}
+
+/**
+ * Generates a photo-like test image and saves it to a scratch file, then lists the
+ * decoder, the encoder and every filter as kernels working on them
+ * @param width      width of the test image
+ * @param height     height of the test image
+ * @param image      set to the test image
+ * @param name       set to the name of the scratch file, which the caller removes
+ * @param benchmarks set to the kernels, which use the image and the scratch file
+ * @return True if the scratch file could be written and false otherwise
+ */
+bool make_filter_benchmarks(int width, int height, vector<vector<Pixel> >& image, string& name, vector<Benchmark>& benchmarks)
+{
+    // A photo-like image, since some filters take longer on some colors
+    image.assign(height, vector<Pixel>(width));
+    parallel_for_rows(height, [&](int first, int last) {
+        for (int row = first; row < last; row++)
+        {
+            generate_row(2, 1, width, height, row, image[row].data());
+        }
+    });
+
+    const char* directory = getenv("TMPDIR");
+    name = string(directory ? directory : "/tmp") + "/bench-XXXXXX";
+    int scratch = mkstemp(&name[0]);
+    if (scratch < 0 || !write_image(name, image))
+    {
+        cout << name << ": could not write the test image" << endl;
+        if (scratch >= 0)
+        {
+            close(scratch);
+            unlink(name.c_str());
+        }
+        return false;
+    }
+    close(scratch);
+
+    // The filters with typical parameters, as the menu would apply them
+    const Step steps[] = {{1, 0, 0, 0}, {2, 0.3, 0, 0}, {3, 0, 0, 0}, {4, 0, 0, 0}, {5, 2, 0, 0},
+                          {6, 2, 2, 0}, {7, 0, 0, 0}, {8, 0.5, 0, 0}, {9, 0.5, 0, 0}, {10, 0, 0, 0},
+                          {11, 30, 0, 0}, {12, 1, 2, 2}, {13, 0, 0, 0}, {14, 0, 0, 0}};
+    double pixel_bytes = (double)width * height * sizeof(Pixel);
+    double file_bytes = (double)width * height * 3 + height * (size_t)((4 - width * 3 % 4) % 4);
+
+    // The copy outlives each run so that freeing it is not timed
+    auto copy = make_shared<vector<vector<Pixel> > >();
+    benchmarks = {
+        {"copy pixels", pixel_bytes * 2, [&image, copy]() { *copy = image; }, {}},
+        {"decode BMP", file_bytes + pixel_bytes, [&name]() { read_image(name); }, {}, true},
+        {"encode BMP", file_bytes + pixel_bytes, [&name, &image]() { write_image(name, image); }, {}, true},
+    };
+    for (const Step& step : steps)
+    {
+        // Input plus output pixels, whose number depends on the filter
+        vector<vector<Pixel> > result = apply_filter(step.choice, image, step.value1, step.value2, step.value3);
+        double output_pixels = result.empty() ? 0 : (double)result.size() * result[0].size();
+        // Point filters run in bands of rows, while flips and the other filters that move pixels run on one thread
+        bool parallel = is_point_filter(step.choice) && step.choice != 13;
+        benchmarks.push_back({"process_" + to_string(step.choice), pixel_bytes + output_pixels * sizeof(Pixel),
+                              [&image, step]() { apply_filter(step.choice, image, step.value1, step.value2, step.value3); }, {}, parallel});
+    }
+    return true;
+}
+
+/**
+ * Times the decoder, the encoder and every filter on a test image
+ * @param width    width of the test image
+ * @param height   height of the test image
+ * @param roofline the copy bandwidth of each memory level
+ * @param counters open perf_event counters, or nullptr to only time the kernels
+ * @return 0 if the test image could be written and 1 otherwise
+ */
+int bench_filters(int width, int height, const Roofline& roofline, PerfCounters* counters)
+{
+    vector<vector<Pixel> > image;
+    string name;
+    vector<Benchmark> benchmarks;
+    if (!make_filter_benchmarks(width, height, image, name, benchmarks))
+    {
+        return 1;
+    }
+
+    cout << endl << "Codec and filters on a " << width << "x" << height << " image (best of 3 runs)" << endl;
+    run_benchmarks(benchmarks, 3, (double)width * height, roofline, counters);
+    unlink(name.c_str());
+    return 0;
+}
+
+// Most pixels of a bench image (8192 x 8192): the conversion buffers alone take 37 bytes a pixel
+const long long MAX_BENCH_PIXELS = 1LL << 26;
+
+/**
+ * Measures the copy bandwidth of each memory level, then times the pixel format
+ * conversions of the codec on an image of the given size and the decoder, the
+ * encoder and every filter on the same image or on images sized to each memory level
+ * @param width         width of the test image
+ * @param height        height of the test image (at most MAX_BENCH_PIXELS pixels in all)
+ * @param read_counters true to also report hardware performance counters per pixel
+ * @param sweep         true to time the codec and filters at every memory level
+ * @return the number of kernels whose output did not match the scalar kernel, plus
+ *         the number of test images that could not be written
+ */
+int run_bench(int width, int height, bool read_counters, bool sweep)
+{
+    Roofline roofline = measure_roofline();
+    cout << "Copy bandwidth:";
+    for (int level = 0; level < MEMORY_LEVELS; level++)
+    {
+        cout << (level ? "," : "") << " " << MEMORY_LEVEL_NAMES[level];
+        if (level < MEMORY_LEVELS - 1)
+        {
+            cout << " (" << (long long)roofline.sizes[level] / 1024 << " KB)";
+        }
+        cout << " " << fixed << setprecision(2) << roofline.rates[level] << " GB/s";
+    }
+    cout.unsetf(ios::floatfield);
+    cout << endl << endl;
+
+    // Byte counts are 64-bit, as in the codec
+    size_t count = (size_t)width * height;
+    vector<unsigned char> bgr(count * 3), bgrx(count * 4), bytes(count * 3), scalar_bytes(count * 3);
+    vector<Pixel> pixels(count), scalar_pixels(count);
+    for (size_t i = 0; i < count * 4; i++)
+    {
+        bgrx[i] = (i * 7 + i / 4093) & 0xFF;
+    }
+    for (size_t i = 0; i < count * 3; i++)
+    {
+        // The same pixels as the 32-bit buffer, without the unused bytes
+        bgr[i] = bgrx[i / 3 * 4 + i % 3];
+    }
+    bgr24_to_pixels_scalar(bgr.data(), scalar_pixels.data(), count);
+    pixels_to_bgr24_scalar(scalar_pixels.data(), scalar_bytes.data(), count);
+
+    PerfCounters counters;
+    PerfCounters* used_counters = nullptr;
+    if (read_counters)
+    {
+        if (open_perf_counters(counters))
+        {
+            used_counters = &counters;
+        }
+        else
+        {
+            cout << "Hardware counters are not available (" << strerror(errno)
+                 << "), showing times only" << endl;
+        }
+    }
+
+    // Every conversion must give the same result as the scalar BGR24 kernels
+    auto pixels_match = [&]() {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (pixels[i].red != scalar_pixels[i].red || pixels[i].green != scalar_pixels[i].green ||
+                pixels[i].blue != scalar_pixels[i].blue)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto bytes_match = [&]() { return bytes == scalar_bytes; };
+
+    // File-side bytes plus 12 bytes per pixel for the pixels
+    double bgr_bytes = count * (3.0 + sizeof(Pixel));
+    double bgrx_bytes = count * (4.0 + sizeof(Pixel));
+    vector<Benchmark> benchmarks = {
+        {"memcpy BGR24", count * 6.0, [&]() { memcpy(bytes.data(), bgr.data(), bgr.size()); }, {}},
+        {"BGR24 -> pixels (scalar)", bgr_bytes, [&]() { bgr24_to_pixels_scalar(bgr.data(), pixels.data(), count); }, pixels_match},
+        {"BGRX32 -> pixels (scalar)", bgrx_bytes, [&]() { bgrx32_to_pixels_scalar(bgrx.data(), pixels.data(), count); }, pixels_match},
+        {"pixels -> BGR24 (scalar)", bgr_bytes, [&]() { pixels_to_bgr24_scalar(scalar_pixels.data(), bytes.data(), count); }, bytes_match},
+    };
+#ifdef HAVE_SHUFFLE_KERNELS
+    if (shuffle_kernels_supported())
+    {
+        // The kernels leave the last few pixels to the scalar kernel, as in the codec
+        benchmarks.push_back({"BGR24 -> pixels (SSSE3)", bgr_bytes, [&]() { bgr24_to_pixels(bgr.data(), pixels.data(), count); }, pixels_match});
+        benchmarks.push_back({"BGRX32 -> pixels (SSSE3)", bgrx_bytes, [&]() { bgrx32_to_pixels(bgrx.data(), pixels.data(), count); }, pixels_match});
+        benchmarks.push_back({"pixels -> BGR24 (SSSE3)", bgr_bytes, [&]() { pixels_to_bgr24(scalar_pixels.data(), bytes.data(), count); }, bytes_match});
+    }
+#endif
+
+    cout << "Pixel format conversions on a " << width << "x" << height << " image (best of 5 runs)" << endl;
+    int mismatches = run_benchmarks(benchmarks, 5, count, roofline, used_counters);
+    benchmarks.clear();
+    vector<unsigned char>().swap(bgr);
+    vector<unsigned char>().swap(bgrx);
+    vector<unsigned char>().swap(bytes);
+    vector<unsigned char>().swap(scalar_bytes);
+    vector<Pixel>().swap(pixels);
+    vector<Pixel>().swap(scalar_pixels);
+
+    if (!sweep)
+    {
+        mismatches += bench_filters(width, height, roofline, used_counters);
+    }
+    for (int level = 0; level < MEMORY_LEVELS && sweep; level++)
+    {
+        // A 4:3 image whose input and output pixels take half the level, or four times the last level cache
+        double working_set = (level < MEMORY_LEVELS - 1) ? roofline.sizes[level] / 2 : roofline.sizes[level - 1] * 4;
+        int level_width = max(16, (int)sqrt(working_set / (2 * sizeof(Pixel)) * 4 / 3));
+        int level_height = max(12, level_width * 3 / 4);
+        cout << endl << "Working set for " << MEMORY_LEVEL_NAMES[level] << ":";
+        mismatches += bench_filters(level_width, level_height, roofline, used_counters);
+    }
+
+    if (used_counters)
+    {
+        close_perf_counters(counters);
+    }
+    return mismatches;
+}
+
+// A kernel gaining less than this fraction from one more thread has saturated
+const double SCALING_GAIN = 0.1;
+
+/**
+ * Times the decoder, the encoder and the filters that run in bands of rows (the
+ * point filters) at 1 to the given number of threads and writes the results as
+ * CSV: strong scaling keeps the image sizes fixed, weak scaling grows the image
+ * with the threads. Prints for each kernel where adding threads stops raising its
+ * bandwidth. Kernels that run on one thread are left out, as their curves would
+ * only show that.
+ * @param output      the CSV filename
+ * @param max_threads the largest number of threads
+ * @return the number of test images that could not be written
+ */
+int run_scaling(string output, int max_threads)
+{
+    ofstream csv(output);
+    if (!csv.is_open())
+    {
+        cout << output << ": could not write" << endl;
+        return 1;
+    }
+    csv << "study,kernel,width,height,threads,ms,GB/s,speedup,efficiency,saturated" << endl;
+    csv << fixed << setprecision(4);
+    int failures = 0;
+
+    // Strong scaling: the same images on more threads
+    const int sizes[][2] = {{640, 480}, {2000, 1500}, {4000, 3000}};
+    for (const int* size : sizes)
+    {
+        vector<vector<Pixel> > image;
+        string name;
+        vector<Benchmark> benchmarks;
+        if (!make_filter_benchmarks(size[0], size[1], image, name, benchmarks))
+        {
+            failures++;
+            continue;
+        }
+
+        for (const Benchmark& benchmark : benchmarks)
+        {
+            if (!benchmark.parallel)
+            {
+                continue;
+            }
+
+            // A kernel saturates at the first thread count that one more thread speeds up
+            // by less than SCALING_GAIN, which is only known after timing one more thread
+            vector<double> seconds(max_threads + 1), rates(max_threads + 1);
+            int saturated = 0;
+            for (int threads = 1; threads <= max_threads; threads++)
+            {
+                worker_threads = threads;
+                seconds[threads] = time_best(benchmark.run, 3);
+                rates[threads] = benchmark.bytes / seconds[threads] / 1e9;
+                if (saturated == 0 && threads > 1 && rates[threads] < rates[threads - 1] * (1 + SCALING_GAIN))
+                {
+                    saturated = threads - 1;
+                }
+            }
+            for (int threads = 1; threads <= max_threads; threads++)
+            {
+                csv << "strong," << benchmark.name << "," << size[0] << "," << size[1] << "," << threads << ","
+                    << seconds[threads] * 1000 << "," << rates[threads] << "," << seconds[1] / seconds[threads] << ","
+                    << seconds[1] / seconds[threads] / threads << "," << (threads == saturated) << endl;
+            }
+
+            cout << benchmark.name << " " << size[0] << "x" << size[1] << ": ";
+            if (saturated > 0)
+            {
+                cout << "saturates at " << saturated << (saturated == 1 ? " thread (" : " threads (") << fixed << setprecision(2) << rates[saturated] << " GB/s)";
+            }
+            else
+            {
+                cout << "still scaling at " << max_threads << " threads (" << fixed << setprecision(2) << rates[max_threads] << " GB/s)";
+            }
+            cout.unsetf(ios::floatfield);
+            cout << endl;
+        }
+        unlink(name.c_str());
+    }
+
+    // Weak scaling: 1000x750 pixels per thread, so an ideal kernel takes the same time at any count
+    vector<double> first_seconds;
+    for (int threads = 1; threads <= max_threads; threads++)
+    {
+        vector<vector<Pixel> > image;
+        string name;
+        vector<Benchmark> benchmarks;
+        worker_threads = threads;
+        if (!make_filter_benchmarks(1000, 750 * threads, image, name, benchmarks))
+        {
+            failures++;
+            break;
+        }
+        for (size_t i = 0; i < benchmarks.size(); i++)
+        {
+            if (!benchmarks[i].parallel)
+            {
+                continue;
+            }
+            double seconds = time_best(benchmarks[i].run, 3);
+            if (threads == 1)
+            {
+                first_seconds.resize(benchmarks.size());
+                first_seconds[i] = seconds;
+            }
+            csv << "weak," << benchmarks[i].name << ",1000," << 750 * threads << "," << threads << ","
+                << seconds * 1000 << "," << benchmarks[i].bytes / seconds / 1e9 << ","
+                << first_seconds[i] / seconds * threads << "," << first_seconds[i] / seconds << ",0" << endl;
         }
+        unlink(name.c_str());
+    }
+
+    worker_threads = 0;
+    return failures;
+}
+
+// Latency histograms keep 64 buckets per power of two, so every recorded
+// latency is within about 1.5% of its bucket's value at any scale
+const int HISTOGRAM_SUB_BUCKETS = 64;
+
+// Latency histogram structure
+// Counts of latencies in microseconds in buckets of logarithmic width, like an HDR histogram
+struct LatencyHistogram
+{
+    vector<long long> counts;
+    long long total;
+    long long largest;
+};
+
+/**
+ * Adds a latency to a histogram
+ * @param histogram the histogram
+ * @param micros    the latency in microseconds
+ * @return nothing
+ */
+void record_latency(LatencyHistogram& histogram, long long micros)
+{
+    micros = max(0LL, micros);
+    int bits = 64 - __builtin_clzll(micros | 1);
+    int shift = max(0, bits - 7);
+    size_t bucket = (size_t)HISTOGRAM_SUB_BUCKETS * shift + (micros >> shift);
+    if (bucket >= histogram.counts.size())
+    {
+        histogram.counts.resize(bucket + 1, 0);
+    }
+    histogram.counts[bucket]++;
+    histogram.total++;
+    histogram.largest = max(histogram.largest, micros);
+}
+
+/**
+ * Adds the latencies of one histogram to another
+ * @param histogram the histogram to add to
+ * @param other     the histogram to add
+ * @return nothing
+ */
+void merge_histogram(LatencyHistogram& histogram, const LatencyHistogram& other)
+{
+    if (other.counts.size() > histogram.counts.size())
+    {
+        histogram.counts.resize(other.counts.size(), 0);
+    }
+    for (size_t i = 0; i < other.counts.size(); i++)
+    {
+        histogram.counts[i] += other.counts[i];
+    }
+    histogram.total += other.total;
+    histogram.largest = max(histogram.largest, other.largest);
+}
 
-        // Save the new color values to the corresponding pixel in the new 2D vector
-        new_image[row][col].red = new_red;
-        new_image[row][col].green = new_green;
-        new_image[row][col].blue = new_blue;
+/**
+ * Finds the latency below which a given fraction of the recorded latencies fall
+ * @param histogram the histogram
+ * @param fraction  the fraction, such as 0.99 for the 99th percentile
+ * @return the largest latency of the bucket of the percentile in microseconds
+ */
+long long latency_percentile(const LatencyHistogram& histogram, double fraction)
+{
+    long long wanted = max(1LL, (long long)ceil(fraction * histogram.total));
+    long long seen = 0;
+    for (size_t bucket = 0; bucket < histogram.counts.size(); bucket++)
+    {
+        seen += histogram.counts[bucket];
+        if (seen >= wanted)
+        {
+            int shift = max(0, (int)(bucket / HISTOGRAM_SUB_BUCKETS) - 1);
+            long long upper = (((long long)bucket - HISTOGRAM_SUB_BUCKETS * shift + 1) << shift) - 1;
+            return min(upper, histogram.largest);
         }
     }
+    return histogram.largest;
+}
 
-    // Return the new 2D vector
-    return new_image;
+/**
+ * Estimates the most memory run_chain() takes at once for an image of the given size,
+ * which is when a filter holds the image it reads and the one it writes, or when the
+ * encoder holds the image and its palette indexes
+ * @param width  width of the input image
+ * @param height height of the input image
+ * @param steps  the filters in the order they are applied
+ * @return the estimate in bytes, or LLONG_MAX if an image of the chain could not exist
+ */
+long long estimate_chain_memory(long long width, long long height, const vector<Step>& steps)
+{
+    // Sizes are checked before every product, so enlargements saturate instead of overflowing
+    // (no image has a side over INT_MAX, and 2^40 pixels is far more than any machine holds)
+    auto impossible = [&]() { return width > INT_MAX || height > INT_MAX || width * height > (1LL << 40); };
+    if (impossible()) {
+        return LLONG_MAX;
+    }
+    long long pixel_bytes = sizeof(Pixel);
+    long long bytes = width * height * pixel_bytes;
+    long long peak = bytes;
+    bool is_gray = false;
+    for (const Step& step : steps) {
+        // The output size of the filter (a rotated canvas is never more than width + height a side)
+        Transform transform;
+        if (step.choice == 11) {
+            if (width + height > INT_MAX) {
+                return LLONG_MAX;
+            }
+            int new_width, new_height;
+            rotated_size(width, height, step.value1, step.value2 != 0, new_width, new_height);
+            width = new_width;
+            height = new_height;
+        } else if (step_transform(step, width, height, transform)) {
+            if (transform.matrix[0][0] == 0) {
+                swap(width, height);
+            }
+            // (scales below 1 are refused, leaving the image as it is)
+            width *= max(1, transform.x_scale);
+            height *= max(1, transform.y_scale);
+        }
+        if (impossible()) {
+            return LLONG_MAX;
+        }
 
+        // Gray images take a byte per pixel, and become color images again for other filters
+        if (!(is_gray && gray_filter_supported(step.choice, step.value1, step.value2, step.value3))) {
+            if (is_gray) {
+                bytes *= pixel_bytes;
+            }
+            is_gray = (step.choice == 3);
+        }
+        long long new_bytes = width * height * (is_gray ? 1 : pixel_bytes);
+        peak = max(peak, bytes + new_bytes);
+        bytes = new_bytes;
+    }
+    return is_gray ? max(peak, bytes * 2) : max(peak, bytes + bytes / pixel_bytes);
 }
 
-vector<vector<Pixel> > process_3(const vector<vector<Pixel> >& image) {
-    // Grayscale image
-    
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+// Priority classes of server jobs: interactive jobs go first and may preempt batch jobs
+const int INTERACTIVE = 0;
+const int BATCH = 1;
+const char* const PRIORITY_NAMES[2] = {"interactive", "batch"};
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+// Chunks of PREEMPTION_ROWS rows a batch job runs between bursts of interactive jobs
+// that pause it: a burst opens a window of this many chunks, in which at most the
+// server's fairness limit of interactive jobs run
+const int PREEMPTION_WINDOW = 16;
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+// Job structure
+// A chain of filters the server runs for a client
+struct Job
+{
+    string input;
+    string output;
+    vector<Step> steps;
+    // INTERACTIVE or BATCH
+    int priority;
+    // Estimated peak memory in bytes, reserved from the server's budget while the job runs
+    long long memory;
+    chrono::steady_clock::time_point queued;
+    // Number of interactive jobs run while this batch job was paused, in all and in
+    // the current preemption window, and chunks of rows run in that window
+    int preemptions;
+    int window_preemptions;
+    int window_chunks;
+    // Set by the worker that runs the job
+    bool done;
+    bool succeeded;
+    double wait_ms;
+    double run_ms;
+    // Bytes and number of allocations the job made, and the most bytes it had in use at once
+    long long allocated;
+    long long allocations;
+    long long peak_memory;
+};
+
+// Job server structure
+// A queue of jobs per priority class and the pool of worker threads that run them
+struct JobServer
+{
+    mutex lock;
+    // Signaled when a job is queued or finished and when the server stops
+    condition_variable changed;
+    deque<Job*> queues[2];
+    // Length of the interactive queue, which batch jobs check without the lock
+    atomic<int> interactive_waiting;
+    bool stopping;
+    vector<thread> workers;
+    // Memory all running jobs may reserve in bytes (0 for no limit) and memory reserved
+    long long memory_budget;
+    long long reserved_memory;
+    // Memory of the machine, which no job may need more of even without a budget
+    long long physical_memory;
+    // Most jobs that may wait in the queues (0 for no limit)
+    int max_queued;
+    // Most interactive jobs that start in a row while a batch job waits, and that
+    // may pause one batch job per preemption window, so that batch work is never starved
+    int fairness;
+    int interactive_streak;
+    long long finished_jobs;
+    long long rejected_jobs;
+    long long preempted_jobs;
+    // The most memory any job had in use at once, to compare with the estimates
+    long long largest_peak;
+    // Connections being served, which the server outlives
+    int clients;
+    // Time jobs of each class waited in the queue in microseconds
+    LatencyHistogram waits[2];
+};
 
-        // Get the color values for a single pixel in the input 2D vector
-        int red = image[row][col].red;
-        int green = image[row][col].green;
-        int blue = image[row][col].blue;
+/**
+ * Checks whether a job fits in what running jobs leave of the memory budget
+ * @param server the job server
+ * @param job    the job
+ * @return True if the job may start and false otherwise
+ */
+bool job_fits(const JobServer& server, const Job* job)
+{
+    return server.memory_budget == 0 || server.reserved_memory + job->memory <= server.memory_budget;
+}
 
-        // To round a positive floating-point value to the nearest integer, 
-        // add 0.5 and then convert to an integer. (For a negative value, you subtract 0.5.)
-        int gray_value = ((red + green + blue)/3) + 0.5;
+/**
+ * Picks the job a free worker should run next: the first interactive job unless
+ * batch jobs have waited through the fairness limit, then the first batch job
+ * (the server's lock must be held)
+ * @param server the job server
+ * @return the priority class of the job, or -1 if no queued job may start now
+ */
+int next_job_class(const JobServer& server)
+{
+    int first = INTERACTIVE;
+    if (server.queues[INTERACTIVE].empty() || (!server.queues[BATCH].empty() && server.interactive_streak >= server.fairness))
+    {
+        first = BATCH;
+    }
+    // Jobs of a class start in order, so a large job is not passed by smaller ones forever
+    if (server.queues[first].empty() || !job_fits(server, server.queues[first].front()))
+    {
+        return -1;
+    }
+    return first;
+}
 
-        // Save the new color values to the corresponding pixel in the new 2D vector
-        new_image[row][col].red = gray_value; 
-        new_image[row][col].green = gray_value;
-        new_image[row][col].blue = gray_value;
+/**
+ * Takes the first job of a class off its queue and runs it, reserving its memory
+ * while it runs (the server's lock must be held, and is released during the run)
+ * @param server   the job server
+ * @param priority the class of the job
+ * @param guard    the held lock of the server
+ * @return nothing
+ */
+void run_next_job(JobServer& server, int priority, unique_lock<mutex>& guard);
+
+/**
+ * Runs waiting interactive jobs in the middle of a batch job, on the batch job's
+ * thread, up to the fairness limit per PREEMPTION_WINDOW chunks of the batch job
+ * @param server the job server
+ * @param batch  the paused batch job
+ * @return nothing
+ */
+void run_preempting_jobs(JobServer& server, Job& batch)
+{
+    // Every call ends a chunk of the batch job's rows, and enough of them close the window
+    if (batch.window_preemptions > 0 && ++batch.window_chunks >= PREEMPTION_WINDOW)
+    {
+        batch.window_preemptions = 0;
+        batch.window_chunks = 0;
+    }
+    if (server.interactive_waiting == 0 || batch.window_preemptions >= server.fairness)
+    {
+        return;
+    }
+    unique_lock<mutex> guard(server.lock);
+    while (batch.window_preemptions < server.fairness && !server.queues[INTERACTIVE].empty() &&
+           job_fits(server, server.queues[INTERACTIVE].front()))
+    {
+        if (batch.preemptions == 0)
+        {
+            server.preempted_jobs++;
         }
+        batch.preemptions++;
+        batch.window_preemptions++;
+        run_next_job(server, INTERACTIVE, guard);
     }
+}
 
-    // Return the new 2D vector
-    return new_image;
+void run_next_job(JobServer& server, int priority, unique_lock<mutex>& guard)
+{
+    Job* job = server.queues[priority].front();
+    server.queues[priority].pop_front();
+    server.interactive_waiting = server.queues[INTERACTIVE].size();
+    if (priority == BATCH)
+    {
+        server.interactive_streak = 0;
+    }
+    else if (!server.queues[BATCH].empty())
+    {
+        server.interactive_streak++;
+    }
+    server.reserved_memory += job->memory;
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double, milli> waited = start - job->queued;
+    job->wait_ms = waited.count();
+    record_latency(server.waits[priority], (long long)(waited.count() * 1000));
+    guard.unlock();
+
+    // Batch jobs pause between bands of rows for interactive jobs that arrive meanwhile,
+    // and interactive jobs run to the end
+    // (a preempting job counts its allocations apart from the paused job's)
+    const function<void()>* outer_point = preemption_point;
+    function<void()> preempt = [&]() { run_preempting_jobs(server, *job); };
+    preemption_point = (priority == BATCH) ? &preempt : nullptr;
+    AllocationCounters* outer_allocations = job_allocations;
+    AllocationCounters allocations;
+    job_allocations = &allocations;
+    bool succeeded = false;
+    try
+    {
+        succeeded = run_chain(job->input, job->output, job->steps, false);
+    }
+    catch (const bad_alloc&)
+    {
+        // A job larger than its estimate fails on its own instead of taking the server down
+    }
+    catch (const length_error&)
+    {
+    }
+    job_allocations = outer_allocations;
+    preemption_point = outer_point;
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+    guard.lock();
+    server.reserved_memory -= job->memory;
+    job->succeeded = succeeded;
+    job->run_ms = elapsed.count();
+    job->allocated = allocations.bytes;
+    job->allocations = allocations.count;
+    job->peak_memory = allocations.peak;
+    server.largest_peak = max(server.largest_peak, job->peak_memory);
+    job->done = true;
+    server.finished_jobs++;
+    server.changed.notify_all();
+}
+
+/**
+ * Runs queued jobs until the server stops
+ * @param server the job server
+ * @return nothing
+ */
+void run_jobs(JobServer& server)
+{
+    unique_lock<mutex> guard(server.lock);
+    while (true)
+    {
+        int priority = -1;
+        server.changed.wait(guard, [&]() {
+            priority = next_job_class(server);
+            return priority >= 0 || (server.stopping && server.queues[INTERACTIVE].empty() && server.queues[BATCH].empty());
+        });
+        if (priority < 0)
+        {
+            return;
+        }
+        run_next_job(server, priority, guard);
+    }
+}
 
+/**
+ * Starts the worker threads of a job server
+ * @param server        the job server
+ * @param workers       number of jobs to run at once
+ * @param memory_budget memory all running jobs may take in bytes, or 0 for no limit
+ * @param max_queued    most jobs that may wait to run, or 0 for no limit
+ * @param fairness      most interactive jobs that may go ahead of or pause a batch job
+ * @return nothing
+ */
+void start_job_server(JobServer& server, int workers, long long memory_budget, int max_queued, int fairness)
+{
+    server.interactive_waiting = 0;
+    server.stopping = false;
+    server.memory_budget = memory_budget;
+    server.reserved_memory = 0;
+    server.physical_memory = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    server.max_queued = max_queued;
+    server.fairness = fairness;
+    server.interactive_streak = 0;
+    server.finished_jobs = 0;
+    server.rejected_jobs = 0;
+    server.preempted_jobs = 0;
+    server.largest_peak = 0;
+    server.clients = 0;
+    server.waits[INTERACTIVE] = {{}, 0, 0};
+    server.waits[BATCH] = {{}, 0, 0};
+    for (int i = 0; i < workers; i++)
+    {
+        server.workers.emplace_back(run_jobs, ref(server));
+    }
 }
 
-vector<vector<Pixel> > process_4(const vector<vector<Pixel> >& image){
-    // Rotates image by 90 degrees clockwise (not counter-clockwise)
-    
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+/**
+ * Queues a job and waits for a worker to run it, unless the job needs more memory
+ * than the whole budget or the machine has, or the queues are full
+ * @param server the job server
+ * @param job    the job with its class and memory estimate, whose results are set when it returns
+ * @param error  set to why the job was turned away
+ * @return True if the job was run and false if it was turned away
+ */
+bool run_job(JobServer& server, Job& job, string& error)
+{
+    unique_lock<mutex> guard(server.lock);
+    if (job.memory > server.physical_memory)
+    {
+        error = (job.memory == LLONG_MAX) ? string("images of the chain would be too large")
+                : "needs " + to_string(job.memory >> 20) + " MB, more than the machine's " + to_string(server.physical_memory >> 20) + " MB";
+        server.rejected_jobs++;
+        return false;
+    }
+    if (server.memory_budget > 0 && job.memory > server.memory_budget)
+    {
+        error = "needs " + to_string(job.memory >> 20) + " MB, more than the budget of " + to_string(server.memory_budget >> 20) + " MB";
+        server.rejected_jobs++;
+        return false;
+    }
+    int queued = server.queues[INTERACTIVE].size() + server.queues[BATCH].size();
+    if (server.max_queued > 0 && queued >= server.max_queued)
+    {
+        error = "busy, " + to_string(queued) + " jobs queued";
+        server.rejected_jobs++;
+        return false;
+    }
+    job.done = false;
+    job.preemptions = 0;
+    job.window_preemptions = 0;
+    job.window_chunks = 0;
+    job.queued = chrono::steady_clock::now();
+    server.queues[job.priority].push_back(&job);
+    server.interactive_waiting = server.queues[INTERACTIVE].size();
+    server.changed.notify_all();
+    server.changed.wait(guard, [&]() { return job.done; });
+    return true;
+}
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(width_pixels, vector<Pixel> (height_pixels)); // height and width switched
+/**
+ * Lets the workers finish the queued jobs, then stops them
+ * @param server the job server
+ * @return nothing
+ */
+void stop_job_server(JobServer& server)
+{
+    {
+        lock_guard<mutex> guard(server.lock);
+        server.stopping = true;
+        server.changed.notify_all();
+    }
+    for (thread& worker : server.workers)
+    {
+        worker.join();
+    }
+    server.workers.clear();
+}
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
+/**
+ * Reads one line from a socket
+ * @param socket  the socket
+ * @param pending bytes read but not yet returned, kept between calls
+ * @param line    set to the line without its line break
+ * @return True if a line was read and false at the end of the stream
+ */
+bool read_line(int socket, string& pending, string& line)
+{
+    size_t end;
+    while ((end = pending.find('\n')) == string::npos)
+    {
+        char buffer[4096];
+        ssize_t count = recv(socket, buffer, sizeof(buffer), 0);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        pending.append(buffer, count);
+    }
+    line = pending.substr(0, end);
+    pending.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.pop_back();
+    }
+    return true;
+}
+
+/**
+ * Writes a line to a socket
+ * @param socket the socket
+ * @param line   the line without its line break
+ * @return True if successful and false otherwise
+ */
+bool send_line(int socket, string line)
+{
+    line += '\n';
+    size_t sent = 0;
+    while (sent < line.size())
+    {
+        // A client that went away must not kill the server with SIGPIPE
+        ssize_t count = send(socket, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+/**
+ * Opens a TCP socket on the loopback interface
+ * @param port   the port
+ * @param listen true to listen on the port, false to connect to it
+ * @return the socket, or -1 if it could not be opened
+ */
+int open_loopback(int port, bool listen)
+{
+    int descriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (descriptor < 0)
+    {
+        return -1;
+    }
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int on = 1;
+    bool opened;
+    if (listen)
+    {
+        setsockopt(descriptor, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        opened = bind(descriptor, (sockaddr*)&address, sizeof(address)) == 0 && ::listen(descriptor, 64) == 0;
+    }
+    else
+    {
+        opened = connect(descriptor, (sockaddr*)&address, sizeof(address)) == 0;
+        // Replies are single short lines, which must not wait for more data
+        setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (!opened)
+    {
+        close(descriptor);
+        return -1;
+    }
+    return descriptor;
+}
 
-        // Get the color values for a single pixel in the input 2D vector
-        int red = image[row][col].red;
-        int green = image[row][col].green;
-        int blue = image[row][col].blue;
+/**
+ * Describes the state of a job server as a line of NAME=VALUE pairs: jobs run,
+ * turned away and preempted, memory reserved, and for each priority class the jobs
+ * queued and percentiles of the queue wait
+ * @param server the job server
+ * @return the description
+ */
+string job_server_stats(JobServer& server)
+{
+    lock_guard<mutex> guard(server.lock);
+    ostringstream stats;
+    stats << fixed << setprecision(3) << "jobs=" << server.finished_jobs << " rejected=" << server.rejected_jobs
+          << " preempted=" << server.preempted_jobs << " reserved_mb=" << (server.reserved_memory >> 20)
+          << " budget_mb=" << (server.memory_budget >> 20) << " job_peak_max_mb=" << (server.largest_peak >> 20);
+    for (int priority = INTERACTIVE; priority <= BATCH; priority++)
+    {
+        const LatencyHistogram& waits = server.waits[priority];
+        string name = PRIORITY_NAMES[priority];
+        stats << " " << name << "_queued=" << server.queues[priority].size()
+              << " " << name << "_wait_p50_ms=" << (waits.total ? latency_percentile(waits, 0.5) / 1000.0 : 0.0)
+              << " " << name << "_wait_p99_ms=" << (waits.total ? latency_percentile(waits, 0.99) / 1000.0 : 0.0)
+              << " " << name << "_wait_max_ms=" << waits.largest / 1000.0;
+    }
+    return stats.str();
+}
 
-        // Perform the operation on the color values (refer to Runestone for this)
+/**
+ * Answers the requests of one client of the server, one line each:
+ * [batch] IN.bmp OUT.bmp STEP... runs a chain, as a batch job if the line starts with
+ * "batch", and is answered with "ok RUN_MS WAIT_MS ALLOCATED_MB ALLOCATIONS PEAK_MB" (the
+ * memory the job allocated and the most it had in use at once) or "error MESSAGE", "stats" is
+ * answered with "ok " and the server's statistics, and "shutdown" stops the server
+ * @param server    the job server
+ * @param client    the client's socket
+ * @param listener  the listening socket, shut down to stop the server
+ * @return nothing
+ */
+void serve_client(JobServer& server, int client, int listener)
+{
+    string pending, line;
+    while (read_line(client, pending, line))
+    {
+        if (line == "shutdown")
+        {
+            send_line(client, "ok");
+            shutdown(listener, SHUT_RDWR);
+            break;
+        }
+        if (line == "stats")
+        {
+            if (!send_line(client, "ok " + job_server_stats(server)))
+            {
+                break;
+            }
+            continue;
+        }
+
+        Job job;
+        istringstream words(line);
+        string word;
+        words >> job.input;
+        job.priority = INTERACTIVE;
+        if (job.input == "batch")
+        {
+            job.priority = BATCH;
+            words >> job.input;
+        }
+        words >> job.output;
+        Step step;
+        while (words >> word)
+        {
+            if (!parse_step(word, step))
+            {
+                job.steps.clear();
+                break;
+            }
+            job.steps.push_back(step);
+        }
+        if (job.steps.empty())
+        {
+            if (!send_line(client, "error expected IN.bmp OUT.bmp STEP..."))
+            {
+                break;
+            }
+            continue;
+        }
+
+        // The memory a job needs follows from the image size in its headers
+        BmpInfo info;
+        string error;
+        ostringstream reply;
+        reply << fixed << setprecision(3);
+        if (!probe_image(job.input, info))
+        {
+            reply << "error could not read " << job.input;
+        }
+        else
+        {
+            job.memory = estimate_chain_memory(info.width, info.height, job.steps);
+            if (!run_job(server, job, error))
+            {
+                reply << "error " << error;
+            }
+            else if (job.succeeded)
+            {
+                const double MB = 1024.0 * 1024.0;
+                reply << "ok " << job.run_ms << " " << job.wait_ms << " " << job.allocated / MB << " "
+                      << job.allocations << " " << job.peak_memory / MB;
+            }
+            else
+            {
+                reply << "error could not process " << job.input;
+            }
+        }
+        if (!send_line(client, reply.str()))
+        {
+            break;
+        }
+    }
+    close(client);
+
+    // The server waits for every client to finish, so this is the last use of it
+    lock_guard<mutex> guard(server.lock);
+    server.clients--;
+    server.changed.notify_all();
+}
+
+/**
+ * Runs filter chains for clients on the loopback interface until a client sends
+ * "shutdown", with a thread per connection and a pool of workers running the jobs
+ * @param port          the port to listen on
+ * @param workers       number of jobs to run at once
+ * @param memory_budget memory all running jobs may take in bytes, or 0 for no limit
+ * @param max_queued    most jobs that may wait to run, or 0 for no limit
+ * @param fairness      most interactive jobs that may go ahead of or pause a batch job
+ * @return 0 if the server ran and 1 if it could not listen
+ */
+int run_serve(int port, int workers, long long memory_budget, int max_queued, int fairness)
+{
+    int listener = open_loopback(port, true);
+    if (listener < 0)
+    {
+        cout << "Could not listen on 127.0.0.1:" << port << " (" << strerror(errno) << ")" << endl;
+        return 1;
+    }
+    JobServer server;
+    start_job_server(server, workers, memory_budget, max_queued, fairness);
+    cout << "Listening on 127.0.0.1:" << port << " with " << workers << " workers" << endl;
 
-        // Save the new color values to the corresponding pixel in the new 2D vector
-        new_image[col][(height_pixels - 1) - row].red = red; 
-        new_image[col][(height_pixels - 1) - row].green = green;
-        new_image[col][(height_pixels - 1) - row].blue = blue;
+    // Client threads are detached, so finished ones do not pile up in a long-running server
+    while (true)
+    {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (client < 0)
+        {
+            break;
+        }
+        {
+            lock_guard<mutex> guard(server.lock);
+            server.clients++;
         }
+        thread(serve_client, ref(server), client, listener).detach();
     }
-    // Return the new 2D vector
-    return new_image;
 
+    // Clients still connected are served until they hang up
+    {
+        unique_lock<mutex> guard(server.lock);
+        server.changed.wait(guard, [&]() { return server.clients == 0; });
+    }
+    stop_job_server(server);
+    close(listener);
+    cout << job_server_stats(server) << endl;
+    return 0;
 }
 
-vector<vector<Pixel> > process_5(const vector<vector<Pixel> >& image, int number) { // TODO
-    // Rotates image by a specified number of multiples of 90 degrees clockwise
+// Load mix structure
+// One kind of request of a load test and how often it is sent
+struct LoadMix
+{
+    // As given on the command line, [batch:]STEP@WIDTHxHEIGHT[*WEIGHT]
+    string name;
+    string step;
+    // True to send the requests as batch jobs
+    bool batch;
+    int width;
+    int height;
+    double weight;
+    // Generated input image
+    string input;
+};
 
-    int angle = number * 90;
-    if (angle % 90 != 0) {
-        cout << "angle must be a multiple of 90 degrees. Please enter a valid number of rotations." << endl;
-        return image;
-    } else if (angle % 360 == 0) {
-        return image;
-    } else if (angle % 360 == 90) {
-        return process_4(image);
-    } else if (angle % 360 == 180) {
-        return process_4(process_4(image));
-    } else {
-        return process_4(process_4(process_4(image)));
+/**
+ * Parses a load mix entry written as [batch:]STEP@WIDTHxHEIGHT[*WEIGHT]
+ * @param text the entry as given on the command line
+ * @param mix  set to the entry
+ * @return True if the entry is valid and false otherwise
+ */
+bool parse_load_mix(string text, LoadMix& mix)
+{
+    mix.name = text;
+    mix.batch = (text.compare(0, 6, "batch:") == 0);
+    if (mix.batch)
+    {
+        text.erase(0, 6);
+    }
+    size_t at = text.find('@');
+    size_t by = text.find('x', at);
+    size_t star = text.find('*', by);
+    if (at == string::npos || by == string::npos)
+    {
+        return false;
+    }
+    mix.step = text.substr(0, at);
+    Step step;
+    if (!parse_step(mix.step, step))
+    {
+        return false;
+    }
+    mix.weight = 1;
+    if (!parse_number(text.substr(at + 1, by - at - 1), mix.width) ||
+        !parse_number(text.substr(by + 1, star - by - 1), mix.height) ||
+        (star != string::npos && !parse_number(text.substr(star + 1), mix.weight)))
+    {
+        return false;
     }
+    return mix.width > 0 && mix.height > 0 && mix.weight > 0;
 }
 
-vector<vector<Pixel> > process_6(const vector<vector<Pixel> >& image, int x_scale, int y_scale){
-    // Enlarges the image in the x and y direction
-    
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+/**
+ * Prints the count and latency percentiles of a histogram as a table row
+ * @param name      name of the row
+ * @param histogram the histogram
+ * @param errors    number of requests that failed
+ * @return nothing
+ */
+void print_latencies(string name, const LatencyHistogram& histogram, long long errors)
+{
+    cout << left << setw(28) << name << right << setw(8) << histogram.total << setw(8) << errors << fixed << setprecision(2);
+    const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    for (double fraction : fractions)
+    {
+        cout << setw(10) << (histogram.total ? latency_percentile(histogram, fraction) / 1000.0 : 0.0);
+    }
+    cout << setw(10) << histogram.largest / 1000.0 << endl;
+    cout.unsetf(ios::floatfield);
+}
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels*y_scale, vector<Pixel> (width_pixels*x_scale));
+/**
+ * Sends requests to a server on the loopback interface for a while and prints
+ * latency percentiles per kind of request. With a rate, requests are due at random
+ * times of that average rate whether or not earlier ones were answered, and their
+ * latency counts from when they were due; without one, each connection sends its
+ * next request as soon as the last is answered.
+ * @param port        the server's port
+ * @param seconds     how long to send requests for
+ * @param rate        requests per second, or 0 to send them back to back
+ * @param connections number of connections, and so of requests in flight at most
+ * @param mixes       the kinds of request, picked at random in proportion to their weight,
+ *                    each sent as an interactive or a batch job
+ * @return the number of requests that failed
+ */
+long long run_loadgen(int port, double seconds, double rate, int connections, vector<LoadMix> mixes)
+{
+    // One input image per kind of request, generated up front
+    const char* directory = getenv("TMPDIR");
+    string prefix = string(directory ? directory : "/tmp") + "/loadgen-" + to_string(getpid());
+    double total_weight = 0;
+    for (size_t i = 0; i < mixes.size(); i++)
+    {
+        mixes[i].input = prefix + "-" + to_string(i) + ".bmp";
+        total_weight += mixes[i].weight;
+        if (!write_generated_image(mixes[i].input, mixes[i].width, mixes[i].height, 2, i + 1))
+        {
+            cout << mixes[i].input << ": could not write image" << endl;
+            return 1;
+        }
+    }
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels*y_scale; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels*x_scale; col++) { // width (a.k.a. number of columns)
+    // Each connection keeps its own histograms, merged at the end
+    vector<vector<LatencyHistogram> > histograms(connections, vector<LatencyHistogram>(mixes.size(), {{}, 0, 0}));
+    vector<vector<long long> > errors(connections, vector<long long>(mixes.size(), 0));
+    vector<LatencyHistogram> waits(connections, {{}, 0, 0});
+    atomic<long long> next_request(0);
+    atomic<bool> connection_failed(false);
+    auto start = chrono::steady_clock::now();
+    auto end = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+
+    // Random numbers from the request number, so every run sends the same requests at the same times
+    auto uniform = [](long long request, int stream) {
+        return (mix_bits(request * 2 + stream) >> 11) * (1.0 / (1ULL << 53));
+    };
+    vector<double> due_seconds;
+    if (rate > 0)
+    {
+        // Exponential gaps between requests, as from many independent users
+        double due = 0;
+        while (due < seconds)
+        {
+            due_seconds.push_back(due);
+            due += -log(1 - uniform(due_seconds.size(), 0)) / rate;
+        }
+    }
 
-        // Get the color values for a single pixel in the input 2D vector
-        int red = image[(row/y_scale)+0.5][(col/x_scale)+0.5].red;
-        int green = image[(row/y_scale)+0.5][(col/x_scale)+0.5].green;
-        int blue = image[(row/y_scale)+0.5][(col/x_scale)+0.5].blue;
+    vector<thread> clients;
+    for (int c = 0; c < connections; c++)
+    {
+        clients.emplace_back([&, c]() {
+            int server = open_loopback(port, false);
+            if (server < 0)
+            {
+                connection_failed = true;
+                return;
+            }
+            string output = prefix + "-out-" + to_string(c) + ".bmp";
+            string pending, reply;
+            while (true)
+            {
+                long long request = next_request++;
+                auto due = chrono::steady_clock::now();
+                if (rate > 0)
+                {
+                    if (request >= (long long)due_seconds.size())
+                    {
+                        break;
+                    }
+                    due = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(due_seconds[request]));
+                    this_thread::sleep_until(due);
+                }
+                else if (due >= end)
+                {
+                    break;
+                }
 
-        // Perform the operation on the color values (refer to Runestone for this)
-        // python Image -> image.setPixel(x,y,rgb)
+                double pick = uniform(request, 1) * total_weight;
+                size_t kind = 0;
+                while (kind + 1 < mixes.size() && pick >= mixes[kind].weight)
+                {
+                    pick -= mixes[kind].weight;
+                    kind++;
+                }
+                string job = mixes[kind].input + " " + output + " " + mixes[kind].step;
+                if (!send_line(server, (mixes[kind].batch ? "batch " : "") + job) || !read_line(server, pending, reply))
+                {
+                    connection_failed = true;
+                    break;
+                }
+                chrono::duration<double, micro> latency = chrono::steady_clock::now() - due;
+                if (reply.compare(0, 3, "ok ") == 0)
+                {
+                    record_latency(histograms[c][kind], (long long)latency.count());
+
+                    // The server adds how long the job waited in its queue after the run time
+                    istringstream times(reply.substr(3));
+                    double run_ms, wait_ms;
+                    if (times >> run_ms >> wait_ms)
+                    {
+                        record_latency(waits[c], (long long)(wait_ms * 1000));
+                    }
+                }
+                else
+                {
+                    errors[c][kind]++;
+                }
+            }
+            close(server);
+            unlink(output.c_str());
+        });
+    }
+    for (thread& client : clients)
+    {
+        client.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    for (const LoadMix& mix : mixes)
+    {
+        unlink(mix.input.c_str());
+    }
+    if (connection_failed)
+    {
+        cout << "Lost the connection to 127.0.0.1:" << port << endl;
+    }
 
-        // Save the new color values to the corresponding pixel in the new 2D vector
-        new_image[row][col].red = red; 
-        new_image[row][col].green = green;
-        new_image[row][col].blue = blue;
+    LatencyHistogram all = {{}, 0, 0};
+    long long all_errors = 0;
+    cout << left << setw(28) << "request" << right << setw(8) << "count" << setw(8) << "errors"
+         << setw(10) << "p50 ms" << setw(10) << "p90 ms" << setw(10) << "p99 ms" << setw(10) << "p99.9 ms" << setw(10) << "max ms" << endl;
+    for (size_t kind = 0; kind < mixes.size(); kind++)
+    {
+        LatencyHistogram histogram = {{}, 0, 0};
+        long long kind_errors = 0;
+        for (int c = 0; c < connections; c++)
+        {
+            merge_histogram(histogram, histograms[c][kind]);
+            kind_errors += errors[c][kind];
         }
+        print_latencies(mixes[kind].name, histogram, kind_errors);
+        merge_histogram(all, histogram);
+        all_errors += kind_errors;
     }
-
-    // Return the new 2D vector
-    return new_image;
+    print_latencies("all", all, all_errors);
+    LatencyHistogram all_waits = {{}, 0, 0};
+    for (const LatencyHistogram& wait : waits)
+    {
+        merge_histogram(all_waits, wait);
+    }
+    print_latencies("queue wait", all_waits, 0);
+    cout << fixed << setprecision(2) << all.total / elapsed.count() << " requests/s over " << elapsed.count() << " s" << endl;
+    cout.unsetf(ios::floatfield);
+    return all_errors + (connection_failed ? 1 : 0);
 }
 
-vector<vector<Pixel> > process_7(const vector<vector<Pixel> >& image) {
-    // Convert image to high contrast (black and white only)
-    
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+/**
+ * Runs the command given on the command line instead of the interactive menu
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @return the exit status
+ */
+int run_command(int argc, char* argv[])
+{
+    string command = argv[1];
+
+    if (command == "compare" && (argc == 4 || argc == 5)) {
+        vector<vector<Pixel> > first = read_image(argv[2]);
+        vector<vector<Pixel> > second = read_image(argv[3]);
+        if (first.empty() || second.empty()) {
+            cout << "Could not read both images." << endl;
+            return 1;
+        }
+        if (first.size() != second.size() || first[0].size() != second[0].size()) {
+            cout << "Images have different sizes: " << first[0].size() << "x" << first.size()
+                 << " and " << second[0].size() << "x" << second.size() << endl;
+            return 1;
+        }
 
+        Comparison comparison = compare_images(first, second);
+        cout << "Max abs diff: " << comparison.max_diff << endl;
+        cout << "PSNR: " << comparison.psnr << " dB" << endl;
+        cout << "SSIM: " << comparison.ssim << endl;
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+        if (argc == 5 && !write_image(argv[4], difference_map(first, second))) {
+            cout << "Could not write difference map." << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
-            
-            // Get the color values for a single pixel in the input 2D vector
-            int red = image[row][col].red;
-            int green = image[row][col].green;
-            int blue = image[row][col].blue;
-
-            // Perform the operation on the color values (refer to Runestone for this)
-            int gray_value = (red + green + blue)/3;
-            int new_red, new_green, new_blue;
-
-            if (gray_value >= 255/2) {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
+    if (command == "chain" && argc >= 5) {
+        vector<Step> steps;
+        Step step;
+        bool report_memory = false;
+        for (int i = 4; i < argc; i++) {
+            if (string(argv[i]) == "-m") {
+                report_memory = true;
+            } else if (!parse_step(argv[i], step)) {
+                cout << argv[i] << ": expected FILTER or FILTER:VALUE1[,VALUE2[,VALUE3]]" << endl;
+                return 1;
             } else {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
+                steps.push_back(step);
             }
-
-            // Save the new color values to the corresponding pixel in the new 2D vector
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
         }
+        return run_chain(argv[2], argv[3], steps, report_memory) ? 0 : 1;
     }
-        
-    // Return the new 2D vector
-    return new_image;
-}
-
-vector<vector<Pixel> > process_8(const vector<vector<Pixel> >& image, double scaling_factor) {
-    // Lightens image by a scaling factor
-    
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
-
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
-            
-            // Get the color values for a single pixel in the input 2D vector
-            int red = image[row][col].red;
-            int green = image[row][col].green;
-            int blue = image[row][col].blue;
 
-            // Perform the operation on the color values (refer to Runestone for this)
-            //DO THE SPECIAL STUFF HERE
-            int new_red, new_green, new_blue;
-
-            new_red = 255 - (255 - red) * scaling_factor;
-            new_green = 255 - (255 - green) * scaling_factor;
-            new_blue = 255 - (255 - blue) * scaling_factor;
-
-            // Save the new color values to the corresponding pixel in the new 2D vector
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+    if (command == "stream" && argc >= 5) {
+        vector<Step> steps;
+        Step step;
+        for (int i = 4; i < argc; i++) {
+            if (!parse_step(argv[i], step)) {
+                cout << argv[i] << ": expected FILTER or FILTER:VALUE1[,VALUE2[,VALUE3]]" << endl;
+                return 1;
+            }
+            steps.push_back(step);
         }
+        return run_stream(argv[2], argv[3], steps) ? 0 : 1;
     }
-        
-    // Return the new 2D vector
-    return new_image;
-}
-
-vector<vector<Pixel> > process_9(const vector<vector<Pixel> >& image, double scaling_factor) {
-    // Darkens image by a scaling factor
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
-            
-            // Get the color values for a single pixel in the input 2D vector
-            int red = image[row][col].red;
-            int green = image[row][col].green;
-            int blue = image[row][col].blue;
-
-            int new_red, new_green, new_blue;
+    if (command == "tiled" && argc >= 6) {
+        vector<Step> steps;
+        Step step;
+        for (int i = 5; i < argc; i++) {
+            if (!parse_step(argv[i], step)) {
+                cout << argv[i] << ": expected FILTER or FILTER:VALUE1[,VALUE2[,VALUE3]]" << endl;
+                return 1;
+            }
+            steps.push_back(step);
+        }
+        double megabytes = 0;
+        if (!parse_number(argv[4], megabytes) || megabytes <= 0) {
+            cout << argv[4] << ": expected a number of megabytes" << endl;
+            return 1;
+        }
+        size_t budget = (size_t)(megabytes * 1024 * 1024);
+        return run_tiled(argv[2], argv[3], steps, budget) ? 0 : 1;
+    }
 
-            new_red = red * scaling_factor;
-            new_green = green * scaling_factor;
-            new_blue = blue * scaling_factor;
+    if (command == "preview" && (argc == 4 || argc == 5)) {
+        vector<vector<Pixel> > image = read_image(argv[2]);
+        if (image.empty()) {
+            cout << argv[2] << ": could not read image" << endl;
+            return 1;
+        }
+        bool rgb565 = (argc == 4 || string(argv[4]) != "555");
+        return write_image_16(argv[3], image, rgb565) ? 0 : 1;
+    }
 
-            // Save the new color values to the corresponding pixel in the new 2D vector
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+    if (command == "batch" && argc >= 4) {
+        // Optional -t THRESHOLD, -s, -l and -m flags come after the filter parameters
+        vector<double> values;
+        int threshold = 4;
+        bool skip = false;
+        bool allow_link = false;
+        bool report_memory = false;
+        for (int i = 4; i < argc; i++) {
+            string argument = argv[i];
+            double value;
+            if (argument == "-t" && i + 1 < argc) {
+                if (!parse_number(argv[++i], threshold) || threshold < 0) {
+                    cout << argv[i] << ": expected a number of hash bits" << endl;
+                    return 1;
+                }
+            } else if (argument == "-s") {
+                skip = true;
+            } else if (argument == "-l") {
+                allow_link = true;
+            } else if (argument == "-m") {
+                report_memory = true;
+            } else if (parse_number(argument, value)) {
+                values.push_back(value);
+            } else {
+                cout << argument << ": expected a filter parameter" << endl;
+                return 1;
+            }
+        }
+        int choice;
+        if (!parse_number(argv[3], choice) || choice < 1 || choice > 14) {
+            cout << "Unknown filter: " << argv[3] << endl;
+            return 1;
         }
+        values.resize(3, 0);
+        return run_batch(argv[2], choice, values[0], values[1], values[2], threshold, skip, allow_link, report_memory) == 0 ? 0 : 1;
     }
-        
-    // Return the new 2D vector
-    return new_image;
-}
 
-vector<vector<Pixel> > process_10(const vector<vector<Pixel> >& image) {
-    // Converts image to only black, white, red, blue, and green
-    // Get the number of rows/columns from the input 2D vector
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+    if (command == "bench") {
+        // Optional -p and -r flags come after the size
+        bool read_counters = false;
+        bool sweep = false;
+        vector<int> sizes;
+        int size;
+        for (int i = 2; i < argc; i++) {
+            string argument = argv[i];
+            if (argument == "-p") {
+                read_counters = true;
+            } else if (argument == "-r") {
+                sweep = true;
+            } else if (parse_number(argument, size) && size > 0) {
+                sizes.push_back(size);
+            } else {
+                cout << argument << ": expected a positive size" << endl;
+                return 1;
+            }
+        }
+        if (sizes.empty() || sizes.size() == 2) {
+            int width = sizes.empty() ? 4000 : sizes[0];
+            int height = sizes.empty() ? 3000 : sizes[1];
+            if ((long long)width * height > MAX_BENCH_PIXELS) {
+                cout << width << "x" << height << ": more than the " << MAX_BENCH_PIXELS << " pixels a bench image may have" << endl;
+                return 1;
+            }
+            return run_bench(width, height, read_counters, sweep) == 0 ? 0 : 1;
+        }
+    }
 
+    if (command == "generate" && argc >= 5 && argc <= 7) {
+        int pattern = 2;
+        if (argc >= 6) {
+            pattern = find(PATTERN_NAMES, PATTERN_NAMES + PATTERNS, string(argv[5])) - PATTERN_NAMES;
+        }
+        int width, height;
+        if (pattern == PATTERNS || !parse_number(argv[3], width) || !parse_number(argv[4], height) || width <= 0 || height <= 0) {
+            cout << "Unknown pattern or size" << endl;
+            return 1;
+        }
+        unsigned long long seed = 1;
+        if (argc == 7 && !parse_number(argv[6], seed)) {
+            cout << argv[6] << ": expected a seed from 0 to 2^64 - 1" << endl;
+            return 1;
+        }
+        if (!write_generated_image(argv[2], width, height, pattern, seed)) {
+            cout << argv[2] << ": could not write image" << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel> > new_image(height_pixels, vector<Pixel> (width_pixels));
+    if (command == "scaling" && (argc == 3 || argc == 4)) {
+        int max_threads = max(1, (int)thread::hardware_concurrency());
+        if (argc == 4 && (!parse_number(argv[3], max_threads) || max_threads < 1)) {
+            cout << argv[3] << ": expected a number of threads" << endl;
+            return 1;
+        }
+        return run_scaling(argv[2], max_threads) == 0 ? 0 : 1;
+    }
 
-    // Iterate through the pixels of the input 2D vector (nested loop)
-    for (int row = 0; row < height_pixels; row++) { // height (a.k.a. number of rows) 
-        for (int col = 0; col < width_pixels; col++) { // width (a.k.a. number of columns)
-            
-            // Get the color values for a single pixel in the input 2D vector
-            int red = image[row][col].red;
-            int green = image[row][col].green;
-            int blue = image[row][col].blue;
-
-            // Perform the operation on the color values
-            int max_color = max(max(red, green), blue);
-            int new_red, new_green, new_blue;
-
-            if (red + green + blue >= 550) {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
-            } else if (red + green + blue <= 150) {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
-            } else if (max_color == red) {
-                new_red = 255;
-                new_green = 0;
-                new_blue = 0;
-            } else if (max_color == green) {
-                new_red = 0;
-                new_green = 255;
-                new_blue = 0;
-            } else {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 255;
+    if (command == "serve" && argc >= 3) {
+        // Optional -m MB, -q MAX_QUEUED and -f FAIRNESS flags come after the number of workers
+        int workers = max(1, (int)thread::hardware_concurrency());
+        long long memory_budget = 0;
+        int max_queued = 0;
+        int fairness = 8;
+        for (int i = 3; i < argc; i++) {
+            string argument = argv[i];
+            double megabytes;
+            if (argument == "-m" && i + 1 < argc) {
+                // The budget is kept in bytes, so it must fit in a long long once converted
+                if (!parse_number(argv[++i], megabytes) || megabytes <= 0 || megabytes >= (double)(LLONG_MAX >> 20)) {
+                    cout << argv[i] << ": expected a number of megabytes" << endl;
+                    return 1;
+                }
+                memory_budget = (long long)(megabytes * 1024 * 1024);
+            } else if (argument == "-q" && i + 1 < argc) {
+                if (!parse_number(argv[++i], max_queued) || max_queued < 0) {
+                    cout << argv[i] << ": expected a number of jobs (0 for no limit)" << endl;
+                    return 1;
+                }
+            } else if (argument == "-f" && i + 1 < argc) {
+                if (!parse_number(argv[++i], fairness) || fairness < 1) {
+                    cout << argv[i] << ": expected a number of interactive jobs" << endl;
+                    return 1;
+                }
+            } else if (!parse_number(argument, workers) || workers < 1) {
+                cout << argument << ": expected a number of workers" << endl;
+                return 1;
             }
+        }
+        int port;
+        if (!parse_number(argv[2], port) || port < 1 || port > 65535) {
+            cout << argv[2] << ": expected a port from 1 to 65535" << endl;
+            return 1;
+        }
+        return run_serve(port, workers, memory_budget, max_queued, fairness);
+    }
 
-            // Save the new color values to the corresponding pixel in the new 2D vector
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+    if (command == "loadgen" && argc >= 7) {
+        vector<LoadMix> mixes(argc - 6);
+        for (int i = 6; i < argc; i++) {
+            if (!parse_load_mix(argv[i], mixes[i - 6])) {
+                cout << argv[i] << ": expected STEP@WIDTHxHEIGHT[*WEIGHT]" << endl;
+                return 1;
+            }
+        }
+        int port, connections;
+        double seconds, rate;
+        if (!parse_number(argv[2], port) || port < 1 || port > 65535) {
+            cout << argv[2] << ": expected a port from 1 to 65535" << endl;
+            return 1;
+        }
+        if (!parse_number(argv[3], seconds) || seconds <= 0) {
+            cout << argv[3] << ": expected a number of seconds" << endl;
+            return 1;
         }
+        if (!parse_number(argv[4], rate) || rate < 0) {
+            cout << argv[4] << ": expected a number of jobs per second (0 for back to back)" << endl;
+            return 1;
+        }
+        if (!parse_number(argv[5], connections) || connections < 1) {
+            cout << argv[5] << ": expected a number of connections" << endl;
+            return 1;
+        }
+        return run_loadgen(port, seconds, rate, connections, mixes) == 0 ? 0 : 1;
     }
-        
-    // Return the new 2D vector
-    return new_image;
+
+    if (command == "index" && argc == 4) {
+        return run_index(argv[2], argv[3]) == 0 ? 0 : 1;
+    }
+
+    cout << "Usage:" << endl;
+    cout << "  " << argv[0] << "                                  interactive menu" << endl;
+    cout << "  " << argv[0] << " compare A.bmp B.bmp [DIFF.bmp]   max abs diff, PSNR and SSIM" << endl;
+    cout << "  " << argv[0] << " chain IN.bmp OUT.bmp STEP...      apply menu filters in order, each STEP" << endl;
+    cout << "      written as FILTER or FILTER:VALUE1[,VALUE2[,VALUE3]] (e.g. 3 8:0.5 6:2,2);" << endl;
+    cout << "      -m reports the memory allocated by the decode, each filter and the encode" << endl;
+    cout << "  " << argv[0] << " stream IN.bmp OUT.bmp STEP...     like chain, one row at a time (filters 1-3, 7-10, 13)" << endl;
+    cout << "  " << argv[0] << " tiled IN.bmp OUT.bmp MB STEP...   like chain, out of core in tiles cached within MB" << endl;
+    cout << "      megabytes of memory, for images larger than RAM" << endl;
+    cout << "  " << argv[0] << " preview IN.bmp OUT.bmp [565|555]  save a 16-bit copy (RGB565 by default)" << endl;
+    cout << "  " << argv[0] << " batch LIST FILTER [VALUES] [-t THRESHOLD] [-s] [-l] [-m]" << endl;
+    cout << "      apply menu filter FILTER to each 'input output' line of LIST, reusing (or with -s" << endl;
+    cout << "      skipping) results for inputs within THRESHOLD hash bits of an earlier one;" << endl;
+    cout << "      with -l, copies may be hard links; with -m, prints the memory allocated by each" << endl;
+    cout << "      image's decode, filter and encode" << endl;
+    cout << "  " << argv[0] << " index DIR INDEX.txt               list the size, bit depth and content hash of" << endl;
+    cout << "      each BMP in DIR from its headers, without decoding any pixels" << endl;
+    cout << "  " << argv[0] << " generate OUT.bmp WIDTH HEIGHT [PATTERN] [SEED]  write a synthetic test image;" << endl;
+    cout << "      PATTERN is gradient, noise, texture (the default) or flat" << endl;
+    cout << "  " << argv[0] << " bench [WIDTH HEIGHT] [-p] [-r]    time the pixel format conversions, the codec and every" << endl;
+    cout << "      filter against the copy bandwidth of the memory their data fits in; -p adds hardware" << endl;
+    cout << "      counters per pixel and -r times the codec and filters at L2, LLC and DRAM sizes" << endl;
+    cout << "  " << argv[0] << " scaling OUT.csv [MAX_THREADS]    time the codec and the point filters (1-3, 7-10)," << endl;
+    cout << "      the kernels that split their rows among threads, at 1 to MAX_THREADS threads, with" << endl;
+    cout << "      strong and weak scaling, speedup and efficiency as CSV" << endl;
+    cout << "  " << argv[0] << " serve PORT [WORKERS] [-m MB] [-q MAX_QUEUED] [-f FAIRNESS]  run chains for" << endl;
+    cout << "      clients on 127.0.0.1:PORT, one '[batch] IN.bmp OUT.bmp STEP...' line per job, WORKERS" << endl;
+    cout << "      jobs at once, until 'shutdown'; jobs wait until their estimated memory fits in MB" << endl;
+    cout << "      megabytes, and are turned away beyond MAX_QUEUED waiting jobs; interactive jobs go" << endl;
+    cout << "      first and pause batch jobs, at most FAIRNESS (8) at a time; 'stats' gives the queue waits" << endl;
+    cout << "  " << argv[0] << " loadgen PORT SECONDS RATE CONNECTIONS MIX...  send jobs to a server and" << endl;
+    cout << "      print latency percentiles; RATE is jobs per second (0 sends them back to back)" << endl;
+    cout << "      and each MIX is [batch:]STEP@WIDTHxHEIGHT[*WEIGHT] (e.g. 8:0.5@2000x1500*3 6:2,2@640x480)" << endl;
+    cout << "  -j THREADS before any of these sets the number of worker threads" << endl;
+    return 1;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    // -j THREADS before anything else sets the number of worker threads
+    if (argc > 2 && string(argv[1]) == "-j") {
+        if (!parse_number(argv[2], worker_threads) || worker_threads < 1) {
+            cout << argv[2] << ": expected a number of threads" << endl;
+            return 1;
+        }
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    // Tools such as compare run from the command line and skip the menu
+    if (argc > 1) {
+        return run_command(argc, argv);
+    }
 
     cout <<"Image Processing Application" << endl << endl;
 
@@ -631,6 +6415,10 @@ int main()
         cout << "8) Lighten" << endl;
         cout << "9) Darken" << endl;
         cout << "10) Black, white, red, green, blue" << endl;
+        cout << "11) Rotate by angle" << endl;
+        cout << "12) Rotate and enlarge" << endl;
+        cout << "13) Flip horizontal" << endl;
+        cout << "14) Flip vertical" << endl;
 
         cout << "\n\nEnter menu selection (Q to quit): ";
         cin >> menuSelect;
@@ -646,6 +6434,11 @@ int main()
                     cout << "Change image selected" << endl;
                     cout << "Enter input BMP filename: ";
                     cin >> filename;
+                    image = read_image(filename);
+                    if (image.empty()) {
+                        cout << filename << ": could not read image" << endl;
+                        break;
+                    }
                     cout << "Successfully changed input image!" << endl;
                     break;
                 }
@@ -722,6 +6515,12 @@ int main()
                     cout << "\nEnter number of 90 degree rotations: ";
                     cin >> rotationNum;
 
+                    // Whole turns change nothing, so the input file is copied as is
+                    if (is_identity_chain({{5, (double)rotationNum, 0, 0}}) && copy_file(filename, outputFilename, false)) {
+                        cout << "Successfully applied multiple 90 degree rotations!" << endl;
+                        break;
+                    }
+
                     // Call process_5 function using the 2D vector and save the resulting 2D vector that is returned
                     vector<vector<Pixel> > new_image = process_5(image, rotationNum);
 
@@ -777,6 +6576,12 @@ int main()
                     double scalingFactor;
                     cin >> scalingFactor;
 
+                    // A factor of 1 changes nothing, so the input file is copied as is
+                    if (is_identity_chain({{8, scalingFactor, 0, 0}}) && copy_file(filename, outputFilename, false)) {
+                        cout << "Successfully lightened!" << endl;
+                        break;
+                    }
+
                     // Call process_8 function using the 2D vector and save the resulting 2D vector that is returned
                     vector<vector<Pixel> > new_image = process_8(image, scalingFactor);
 
@@ -797,6 +6602,12 @@ int main()
                     double scalingFactor;
                     cin >> scalingFactor;
 
+                    // A factor of 1 changes nothing, so the input file is copied as is
+                    if (is_identity_chain({{9, scalingFactor, 0, 0}}) && copy_file(filename, outputFilename, false)) {
+                        cout << "Successfully darkened!" << endl;
+                        break;
+                    }
+
                     // Call process_9 function using the 2D vector and save the resulting 2D vector that is returned
                     vector<vector<Pixel> > new_image = process_9(image, scalingFactor);
 
@@ -821,6 +6632,79 @@ int main()
 
                     break;
                 }
+                case 11: {
+                    cout << "Rotate by angle selected" << endl;
+                    cout << "Enter output BMP filename: ";
+                    cin >> outputFilename;
+                    double angle;
+                    cout << "Enter angle in degrees (clockwise): ";
+                    cin >> angle;
+                    string expandChoice;
+                    cout << "Expand canvas to fit the rotated image? (y/n): ";
+                    cin >> expandChoice;
+                    bool expand = (expandChoice == "y" || expandChoice == "Y");
+
+                    // Call process_11 function using the 2D vector and save the resulting 2D vector that is returned
+                    vector<vector<Pixel> > new_image = process_11(image, angle, expand);
+
+                    // Write the resulting 2D vector to a new BMP image file (using write_image function)
+                    if (write_image(outputFilename, new_image)) {
+                        cout << "Successfully applied rotation!" << endl;
+                    }
+
+                    break;
+                }
+                case 12: {
+                    cout << "Rotate and enlarge selected" << endl;
+                    cout << "Enter output BMP filename: ";
+                    cin >> outputFilename;
+                    int rotationNum;
+                    cout << "\nEnter number of 90 degree rotations: ";
+                    cin >> rotationNum;
+                    int x_scale, y_scale;
+                    cout << "Enter X scale: ";
+                    cin >> x_scale;
+                    cout << "\nEnter Y scale: ";
+                    cin >> y_scale;
+
+                    // Call process_12 function using the 2D vector and save the resulting 2D vector that is returned
+                    vector<vector<Pixel> > new_image = process_12(image, rotationNum, x_scale, y_scale);
+
+                    // Write the resulting 2D vector to a new BMP image file (using write_image function)
+                    if (write_image(outputFilename, new_image)) {
+                        cout << "Successfully rotated and enlarged!" << endl;
+                    }
+
+                    break;
+                }
+                case 13: {
+                    cout << "Flip horizontal selected" << endl;
+                    cout << "Enter output BMP filename: ";
+                    cin >> outputFilename;
+
+                    // Flip the loaded image in place, write it, then flip it back for the next operation
+                    flip_horizontal(image);
+                    if (write_image(outputFilename, image)) {
+                        cout << "Successfully flipped horizontally!" << endl;
+                    }
+                    flip_horizontal(image);
+
+                    break;
+                }
+                case 14: {
+                    cout << "Flip vertical selected" << endl;
+                    cout << "Enter output BMP filename: ";
+                    cin >> outputFilename;
+
+                    // Flip the loaded image in place (only row buffers are swapped), write it, then flip it back
+                    flip_vertical(image);
+                    if (write_image(outputFilename, image)) {
+                        cout << "Successfully flipped vertically!" << endl;
+                    }
+                    flip_vertical(image);
+
+                    break;
+                }
                 default: {
                     cout << "Invalid menu selection. Please restart application, and try again." << endl;
                     isDone = true;